@@ -22,21 +22,28 @@
 #define _GNU_SOURCE
 #endif
 #include <ctype.h>
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <fnmatch.h>
+#include <limits.h>
 #include <mntent.h>
 #include <popt.h>
+#include <regex.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <unistd.h>
 #include <libgen.h>
 #include <execinfo.h>
 #include <signal.h>
+#include <pthread.h>
 #include <blkid/blkid.h>
 
 #include "log.h"
+#include "nvr.h"
 
 #ifndef DEBUG
 #define DEBUG 0
@@ -55,10 +62,16 @@ int debug = 0;			/* Currently just for template debugging */
 #define MAX_EXTRA_INITRDS	  16	/* code segment checked by --bootloader-probe */
 #define CODE_SEG_SIZE	  128	/* code segment checked by --bootloader-probe */
 
+#define PARALLEL_PARSE_SIZE (1024 * 1024)	/* see parseEntriesParallel() */
+#define PARALLEL_PARSE_FILES 64	/* see readBlsConfig() */
+
 #define NOOP_OPCODE 0x90
 #define JMP_SHORT_OPCODE 0xeb
 
 int isEfi = 0;
+int diffOutput = 0;		/* --diff: print a unified diff, don't write */
+static int lazyParse = 0;	/* only tokenize the entries we look at */
+static int parseJobs = 0;	/* threads for parsing entries, 0 for auto */
 
 #if defined(__aarch64__)
 #define isEfiOnly	1
@@ -93,6 +106,7 @@ enum lineType_e {
 	LT_LBA = 1 << 12,
 	LT_OTHER = 1 << 13,
 	LT_GENERIC = 1 << 14,
+	LT_SUBMENU = 1 << 15,
 	LT_ECHO = 1 << 16,
 	LT_MENUENTRY = 1 << 17,
 	LT_ENTRY_END = 1 << 18,
@@ -108,15 +122,44 @@ enum lineType_e {
 struct singleLine {
 	char *indent;
 	int numElements;
+	int elementsAlloced;	/* room in elements, see growElements() */
 	struct lineElement *elements;
 	struct singleLine *next;
 	enum lineType_e type;
+	int lineno;		/* line number in the original file, 0 if
+				   the line was created by grubby */
+	char *text;		/* not tokenized yet, see parseEntry() */
+};
+
+/* the line types getEntryLineByType() remembers the first line of */
+static const enum lineType_e cachedLineTypes[] = {
+	LT_KERNEL | LT_KERNEL_EFI | LT_KERNEL_16,
+	LT_INITRD | LT_INITRD_EFI | LT_INITRD_16,
+	LT_KERNELARGS,
+	LT_ROOT,
+	LT_TITLE,
+	LT_MENUENTRY,
+	LT_DEVTREE,
+	LT_HYPER,
+	LT_MBMODULE,
+	LT_ENTRY_END,
 };
 
+#define NUM_CACHED_LINE_TYPES \
+	(sizeof(cachedLineTypes) / sizeof(cachedLineTypes[0]))
+
 struct singleEntry {
 	struct singleLine *lines;
 	int skip;
 	int multiboot;
+	int unparsed;		/* lines left for parseEntry() */
+	int lineTypes;		/* types of all the lines, -1 if out of date */
+	struct singleLine *typeLines[NUM_CACHED_LINE_TYPES];
+	char *file;		/* BLS: name of the entry's file, NULL if new */
+	char *fileText;		/* BLS: the file as read, to skip rewriting it */
+	struct singleEntry *parent;	/* grub2: submenu this entry is in */
+	struct singleEntry **children;	/* grub2: items of this submenu */
+	int numChildren;
 	struct singleEntry *next;
 };
 
@@ -181,6 +224,8 @@ struct configFileInfo {
 	int mbConcatArgs;
 	int mbAllowExtraInitRds;
 	char *envFile;
+	int entryPerFile;	/* the config is a directory with a file for
+				   each entry, see readBlsConfig() */
 };
 
 struct keywordTypes grubKeywords[] = {
@@ -232,6 +277,7 @@ struct configFileInfo grubConfigType = {
 
 struct keywordTypes grub2Keywords[] = {
 	{"menuentry", LT_MENUENTRY, ' '},
+	{"submenu", LT_SUBMENU, ' '},
 	{"}", LT_ENTRY_END, ' '},
 	{"echo", LT_ECHO, ' '},
 	{"set", LT_SET_VARIABLE, ' ', '='},
@@ -293,6 +339,12 @@ const char *grub2FindConfig(struct configFileInfo *cfi)
 	return configFiles[i];
 }
 
+static int stagingFiles = 0;	/* a commit is open, see beginCommit() */
+static FILE *stageFile(const char *path);
+static const char *stagedPath(const char *path);
+static int isKernelOptsRef(const char *item);
+static int readFile(int fd, char **bufPtr);
+
 /* kind of hacky.  It'll give the first 1024 bytes, ish. */
 static char *grub2GetEnv(struct configFileInfo *info, char *name)
 {
@@ -355,6 +407,9 @@ static void unquote(char *s)
 {
 	int l = strlen(s);
 
+	if (l < 2)
+		return;
+
 	if ((s[l - 1] == '\'' && s[0] == '\'')
 	    || (s[l - 1] == '"' && s[0] == '"')) {
 		memmove(s, s + 1, l - 2);
@@ -362,6 +417,101 @@ static void unquote(char *s)
 	}
 }
 
+#define GRUBENV_HEADER "# GRUB Environment Block\n"
+#define GRUBENV_SIZE 1024
+#define KERNELOPTS "kernelopts"	/* see updateKernelOpts() */
+
+/* Rewrite the environment block ourselves so the change can be staged and
+ * committed together with the config file. This writes the same format as
+ * grub2-editenv: name=value lines (with \ and newline escaped by a \)
+ * after the header, padded with '#' to the size of the block. */
+static int grub2StageEnv(const char *envFile, const char *name,
+			 const char *value)
+{
+	char *old = NULL;
+	char *buf, *end, *p;
+	size_t size = GRUBENV_SIZE;
+	size_t headerLen = strlen(GRUBENV_HEADER);
+	size_t nameLen = strlen(name);
+	FILE *out;
+	int fd;
+
+	fd = open(stagedPath(envFile), O_RDONLY);
+	if (fd >= 0) {
+		int rc = readFile(fd, &old);
+		close(fd);
+		if (rc)
+			return -1;
+		/* readFile() guarantees a trailing newline we don't want */
+		size = strlen(old) - 1;
+		if (strncmp(old, GRUBENV_HEADER, headerLen)) {
+			fprintf(stderr,
+				_("grubby: invalid environment block %s\n"),
+				envFile);
+			free(old);
+			return -1;
+		}
+	} else if (errno != ENOENT) {
+		fprintf(stderr, _("grubby: error opening %s for read: %s\n"),
+			envFile, strerror(errno));
+		return -1;
+	}
+
+	buf = end = malloc(size + 2 * strlen(value) + nameLen + 3);
+	end = stpcpy(end, GRUBENV_HEADER);
+
+	/* keep every other variable as it is */
+	for (p = old ? old + headerLen : NULL; p && *p && *p != '#';) {
+		char *start = p;
+
+		while (*p && *p != '\n') {
+			if (*p == '\\' && p[1])
+				p++;
+			p++;
+		}
+		if (*p)
+			p++;
+
+		if (strncmp(start, name, nameLen) || start[nameLen] != '=') {
+			memcpy(end, start, p - start);
+			end += p - start;
+		}
+	}
+
+	end = stpcpy(end, name);
+	*end++ = '=';
+	for (const char *v = value; *v; v++) {
+		if (*v == '\\' || *v == '\n')
+			*end++ = '\\';
+		*end++ = *v;
+	}
+	*end++ = '\n';
+	free(old);
+
+	if (end - buf > size) {
+		fprintf(stderr, _("grubby: environment block %s too small\n"),
+			envFile);
+		free(buf);
+		return -1;
+	}
+	memset(end, '#', size - (end - buf));
+
+	out = stageFile(envFile);
+	if (!out) {
+		free(buf);
+		return -1;
+	}
+	if (fwrite(buf, 1, size, out) != size) {
+		fprintf(stderr, _("grubby: error writing %s: %s\n"), envFile,
+			strerror(errno));
+		free(buf);
+		return -1;
+	}
+
+	free(buf);
+	return 0;
+}
+
 static int grub2SetEnv(struct configFileInfo *info, char *name, char *value)
 {
 	char *s = NULL;
@@ -369,6 +519,8 @@ static int grub2SetEnv(struct configFileInfo *info, char *name, char *value)
 	char *envFile = info->envFile ? info->envFile : "/boot/grub2/grubenv";
 
 	unquote(value);
+	if (stagingFiles)
+		return grub2StageEnv(envFile, name, value);
 	value = shellEscape(value);
 	if (!value)
 		return -1;
@@ -394,27 +546,48 @@ static int is_special_grub2_variable(const char *name)
 	return 0;
 }
 
-int sizeOfSingleLine(struct singleLine *line)
-{
-	int count = 0;
+/* a string which grows as things are appended to it, the text is always
+ * terminated; start from { 0 } and free(sb->str) when done */
+struct strBuf {
+	char *str;
+	size_t len;
+	size_t alloced;
+};
 
-	for (int i = 0; i < line->numElements; i++) {
-		int indentSize = 0;
+static void strBufAppendLen(struct strBuf *sb, const char *str, size_t len)
+{
+	if (sb->len + len + 1 > sb->alloced) {
+		if (!sb->alloced)
+			sb->alloced = 64;
+		while (sb->len + len + 1 > sb->alloced)
+			sb->alloced *= 2;
+		sb->str = realloc(sb->str, sb->alloced);
+	}
+	memcpy(sb->str + sb->len, str, len);
+	sb->len += len;
+	sb->str[sb->len] = '\0';
+}
 
-		count = count + strlen(line->elements[i].item);
+static void strBufAppend(struct strBuf *sb, const char *str)
+{
+	strBufAppendLen(sb, str, strlen(str));
+}
 
-		indentSize = strlen(line->elements[i].indent);
-		if (indentSize > 0)
-			count = count + indentSize;
-		else
-			/* be extra safe and add room for whitespaces */
-			count = count + 1;
-	}
+static void strBufReset(struct strBuf *sb)
+{
+	sb->len = 0;
+	if (sb->str)
+		*sb->str = '\0';
+}
 
-	/* room for trailing terminator */
-	count = count + 1;
+/* hand over the text, which is "" if nothing was appended */
+static char *strBufFinish(struct strBuf *sb)
+{
+	char *str = sb->str ? sb->str : strdup("");
 
-	return count;
+	sb->str = NULL;
+	sb->len = sb->alloced = 0;
+	return str;
 }
 
 static int isquote(char q)
@@ -439,13 +612,16 @@ static int isinitrd(enum lineType_e type)
 char *grub2ExtractTitle(struct singleLine *line)
 {
 	char *current;
-	char *current_indent;
 	int current_len;
-	int current_indent_len;
 	int i;
 
-	/* bail out if line does not start with menuentry */
-	if (strcmp(line->elements[0].item, "menuentry"))
+	/* bail out if line does not start with menuentry or submenu */
+	if (strcmp(line->elements[0].item, "menuentry") &&
+	    strcmp(line->elements[0].item, "submenu"))
+		return NULL;
+
+	/* "submenu {" doesn't have a title */
+	if (line->numElements < 2 || !strcmp(line->elements[1].item, "{"))
 		return NULL;
 
 	i = 1;
@@ -469,39 +645,65 @@ char *grub2ExtractTitle(struct singleLine *line)
 
 	/* second element start with a quote, so we have to find the element
 	 * whose last character is also quote (assuming it's the closing one) */
-	int resultMaxSize;
-	char *result;
+	struct strBuf result = { 0 };
 	/* need to ensure that ' does not match " as we search */
 	char quote_char = *current;
 
-	resultMaxSize = sizeOfSingleLine(line);
-	result = malloc(resultMaxSize);
-	snprintf(result, resultMaxSize, "%s", ++current);
+	strBufAppend(&result, current + 1);
 
-	i++;
-	int result_len = 0;
-	for (; i < line->numElements; ++i) {
+	for (i++; i < line->numElements; ++i) {
 		current = line->elements[i].item;
 		current_len = strlen(current);
-		current_indent = line->elements[i].indent;
-		current_indent_len = strlen(current_indent);
 
-		memcpy(result + result_len, current_indent, current_indent_len);
-		result_len += current_indent_len;
+		/* the indent is what follows an element */
+		strBufAppend(&result, line->elements[i - 1].indent);
 
 		if (current[current_len - 1] != quote_char) {
-			memcpy(result + result_len, current_indent,
-			       current_indent_len);
-			result_len += current_len;
+			strBufAppendLen(&result, current, current_len);
 		} else {
-			memcpy(result + result_len, current_indent,
-			       current_indent_len);
-			result_len += (current_len - 1);
+			strBufAppendLen(&result, current, current_len - 1);
 			break;
 		}
 	}
-	result[result_len] = '\0';
-	return result;
+	return strBufFinish(&result);
+}
+
+/* the id a menuentry or submenu line gives with --id, which grub2-mkconfig
+ * writes as $menuentry_id_option. Once readConfig() has joined the title,
+ * everything after it is in one element, so the words are split again. */
+static char *grub2ExtractId(struct singleLine *line)
+{
+	struct strBuf words = { 0 };
+	char *text, *word, *next = NULL, *save = NULL, *id = NULL;
+	int len;
+
+	for (int i = 2; i < line->numElements; i++) {
+		strBufAppend(&words, line->elements[i].item);
+		strBufAppend(&words, " ");
+	}
+	text = strBufFinish(&words);
+	if (!text)
+		return NULL;
+
+	for (word = strtok_r(text, " \t", &save); word && !id; word = next) {
+		next = strtok_r(NULL, " \t", &save);
+		if (!strncmp(word, "--id=", 5))
+			id = word + 5;
+		else if (next && (!strcmp(word, "--id") ||
+				  !strcmp(word, "$menuentry_id_option") ||
+				  !strcmp(word, "${menuentry_id_option}")))
+			id = next;
+	}
+
+	if (id) {
+		len = strlen(id);
+		if (len >= 2 && isquote(*id) && id[len - 1] == *id)
+			id = strndup(id + 1, len - 2);
+		else
+			id = strdup(id);
+	}
+	free(text);
+	return id;
 }
 
 struct configFileInfo grub2ConfigType = {
@@ -678,6 +880,39 @@ struct configFileInfo extlinuxConfigType = {
 	.titlePosition = 1,
 };
 
+struct keywordTypes blsKeywords[] = {
+	{"title", LT_TITLE, ' '},
+	{"linux", LT_KERNEL, ' '},
+	{"initrd", LT_INITRD, ' ', ' '},
+	{"options", LT_KERNELARGS, ' '},
+	{"devicetree", LT_DEVTREE, ' '},
+	{NULL, 0, 0},
+};
+
+/* BootLoaderSpec: one file per entry in /boot/loader/entries, the default
+ * is the id (file name without .conf) of an entry in the grub2 environment
+ * block */
+struct configFileInfo blsConfigType = {
+	.defaultConfig = "/boot/loader/entries",
+	.getEnv = grub2GetEnv,
+	.setEnv = grub2SetEnv,
+	.keywords = blsKeywords,
+	.defaultIsIndex = 1,
+	.entryStart = LT_TITLE,
+	.needsBootPrefix = 1,
+	.titlePosition = 1,
+	.entryPerFile = 1,
+};
+
+#define ENTRY_ID_BUCKETS 256
+
+struct entryId {
+	char *id;
+	struct singleEntry *entry;
+	int index;		/* of entry in cfg->entries */
+	struct entryId *next;
+};
+
 struct grubConfig {
 	struct singleLine *theLines;
 	struct singleEntry *entries;
@@ -690,6 +925,18 @@ struct grubConfig {
 	struct configFileInfo *cfi;
 	int isModified;		/* assumes only one entry added
 				   per invocation of grubby */
+	char *origText;		/* raw file contents, only kept for --diff */
+	char **origLines;
+	int numOrigLines;
+	char *kernelOpts;	/* new value of $kernelopts, see
+				   updateKernelOpts() */
+	char *envKernelOpts;	/* value it had, see getKernelOpts() */
+	int haveEnvKernelOpts;
+	struct singleEntry **menu;	/* grub2: top level menu items, see
+					   findEntryByMenuPath() */
+	int numMenu;
+	struct entryId **entryIds;	/* hash of the ids of the entries read,
+					   see findEntryById() */
 };
 
 blkid_cache blkid;
@@ -700,6 +947,10 @@ struct singleEntry *findEntryByPath(struct grubConfig *cfg,
 				    int *index);
 struct singleEntry *findEntryByTitle(struct grubConfig *cfg, char *title,
 				     int *index);
+struct singleEntry *findEntryByMenuPath(struct grubConfig *cfg,
+					const char *path, int *index);
+static struct singleEntry *findEntryBySavedEntry(struct grubConfig *cfg,
+						 char *value, int *index);
 static int readFile(int fd, char **bufPtr);
 static void lineInit(struct singleLine *line);
 struct singleLine *lineDup(struct singleLine *line);
@@ -714,13 +965,21 @@ static void requote(struct singleLine *line, struct configFileInfo *cfi);
 static void insertElement(struct singleLine *line,
 			  const char *item, int insertHere,
 			  struct configFileInfo *cfi);
+static void growElements(struct singleLine *line, int count);
+static void insertElements(struct singleLine *line, const char **items,
+			   const int *positions, int count,
+			   struct configFileInfo *cfi);
 static void removeElement(struct singleLine *line, int removeHere);
+static void removeElements(struct singleLine *line, const int *positions,
+			   int count);
 static struct keywordTypes *getKeywordByType(enum lineType_e type,
 					     struct configFileInfo *cfi);
 static enum lineType_e getTypeByKeyword(char *keyword,
 					struct configFileInfo *cfi);
 static struct singleLine *getLineByType(enum lineType_e type,
 					struct singleLine *line);
+static struct singleLine *getEntryLineByType(enum lineType_e type,
+					     struct singleEntry *entry);
 static int checkForExtLinux(struct grubConfig *config);
 struct singleLine *addLineTmpl(struct singleEntry *entry,
 			       struct singleLine *tmplLine,
@@ -838,20 +1097,153 @@ static char *getKeyByType(enum lineType_e type, struct configFileInfo *cfi)
 	return "unknown";
 }
 
+/* What getpathbyspec() and getuuidbydev() found, including when they
+ * didn't, so nothing is looked up twice. */
+struct blkidResult {
+	char *key;
+	char *value;
+	struct blkidResult *next;
+};
+
+static struct blkidResult *findBlkidResult(struct blkidResult *results,
+					   const char *key)
+{
+	for (; results; results = results->next) {
+		if (!strcmp(results->key, key))
+			break;
+	}
+	return results;
+}
+
+static char *addBlkidResult(struct blkidResult **results, const char *key,
+			    char *value)
+{
+	struct blkidResult *result = malloc(sizeof(*result));
+
+	result->key = strdup(key);
+	result->value = value;
+	result->next = *results;
+	*results = result;
+
+	return value;
+}
+
+/* Resolve UUID= and LABEL= through the symlinks udev keeps in /dev/disk,
+ * which saves loading (and maybe revalidating) the whole blkid cache. */
+static char *getpathbylink(const char *spec)
+{
+	static const struct {
+		const char *tag;
+		const char *dir;
+	} links[] = {
+		{ "UUID=", "/dev/disk/by-uuid/" },
+		{ "LABEL=", "/dev/disk/by-label/" },
+		{ "PARTUUID=", "/dev/disk/by-partuuid/" },
+		{ "PARTLABEL=", "/dev/disk/by-partlabel/" },
+	};
+	const char *dir = NULL, *value = NULL;
+	char *path, *devname;
+	size_t len;
+
+	for (unsigned int i = 0; i < sizeof(links) / sizeof(links[0]); i++) {
+		if (!strncmp(spec, links[i].tag, strlen(links[i].tag))) {
+			dir = links[i].dir;
+			value = spec + strlen(links[i].tag);
+			break;
+		}
+	}
+	if (!dir)
+		return NULL;
+
+	len = strlen(value);
+	if (len > 1 && isquote(*value) && value[len - 1] == *value) {
+		value++;
+		len -= 2;
+	}
+
+	/* udev escapes anything else, leave that to blkid */
+	if (!len || strspn(value, "0123456789abcdefghijklmnopqrstuvwxyz"
+			   "ABCDEFGHIJKLMNOPQRSTUVWXYZ#+-.:=@_") < len)
+		return NULL;
+
+	path = alloca(strlen(dir) + len + 1);
+	sprintf(path, "%s%.*s", dir, (int)len, value);
+
+	devname = realpath(path, NULL);
+	if (devname && strncmp(devname, "/dev/", 5)) {
+		free(devname);
+		devname = NULL;
+	}
+
+	return devname;
+}
+
+/* read the UUID of just this device */
+static char *getuuidbyprobe(const char *device)
+{
+	blkid_probe probe;
+	const char *uuid;
+	char *result = NULL;
+
+	if (!(probe = blkid_new_probe_from_filename(device)))
+		return NULL;
+
+	blkid_probe_enable_superblocks(probe, 1);
+	blkid_probe_set_superblocks_flags(probe, BLKID_SUBLKS_UUID);
+	if (!blkid_do_safeprobe(probe) &&
+	    !blkid_probe_lookup_value(probe, "UUID", &uuid, NULL))
+		result = strdup(uuid);
+	blkid_free_probe(probe);
+
+	return result;
+}
+
 static char *getpathbyspec(char *device)
 {
-	if (!blkid)
-		blkid_get_cache(&blkid, NULL);
+	static struct blkidResult *results = NULL;
+	struct blkidResult *result;
+	char *devname;
+
+	if (!device)
+		return NULL;
+
+	if ((result = findBlkidResult(results, device)))
+		return result->value;
+
+	/* a path is its own answer */
+	if (!strchr(device, '='))
+		return addBlkidResult(&results, device, strdup(device));
+
+	devname = getpathbylink(device);
+	if (!devname) {
+		if (!blkid)
+			blkid_get_cache(&blkid, NULL);
+		devname = blkid_get_devname(blkid, device, NULL);
+	}
 
-	return blkid_get_devname(blkid, device, NULL);
+	return addBlkidResult(&results, device, devname);
 }
 
 static char *getuuidbydev(char *device)
 {
-	if (!blkid)
-		blkid_get_cache(&blkid, NULL);
+	static struct blkidResult *results = NULL;
+	struct blkidResult *result;
+	char *uuid;
 
-	return blkid_get_tag_value(blkid, "UUID", device);
+	if (!device)
+		return NULL;
+
+	if ((result = findBlkidResult(results, device)))
+		return result->value;
+
+	uuid = getuuidbyprobe(device);
+	if (!uuid) {
+		if (!blkid)
+			blkid_get_cache(&blkid, NULL);
+		uuid = blkid_get_tag_value(blkid, "UUID", device);
+	}
+
+	return addBlkidResult(&results, device, uuid);
 }
 
 static enum lineType_e getTypeByKeyword(char *keyword,
@@ -879,6 +1271,44 @@ static struct singleLine *getLineByType(enum lineType_e type,
 	return line;
 }
 
+/* Like getLineByType() on the lines of an entry, but answered from what
+ * the entry remembers about its lines where possible. addLine() and
+ * removeLine() mark that as out of date, and it's collected again on the
+ * next lookup. */
+static struct singleLine *getEntryLineByType(enum lineType_e type,
+					     struct singleEntry *entry)
+{
+	struct singleLine *line;
+	int present;
+
+	if (entry->lineTypes < 0) {
+		entry->lineTypes = 0;
+		memset(entry->typeLines, 0, sizeof(entry->typeLines));
+		for (line = entry->lines; line; line = line->next) {
+			entry->lineTypes |= line->type;
+			for (unsigned int i = 0; i < NUM_CACHED_LINE_TYPES; i++) {
+				if (!entry->typeLines[i] &&
+				    (line->type & cachedLineTypes[i]))
+					entry->typeLines[i] = line;
+			}
+		}
+	}
+
+	present = type & entry->lineTypes;
+	if (!present)
+		return NULL;
+
+	/* the first line of a cached group is the answer if the lines asked
+	 * for are all in that group, and the group has no others */
+	for (unsigned int i = 0; i < NUM_CACHED_LINE_TYPES; i++) {
+		if (!(present & ~cachedLineTypes[i]) &&
+		    !(cachedLineTypes[i] & entry->lineTypes & ~type))
+			return entry->typeLines[i];
+	}
+
+	return getLineByType(type, entry->lines);
+}
+
 static int isBracketedTitle(struct singleLine *line)
 {
 	if (line->numElements == 1 && *line->elements[0].item == '[') {
@@ -896,6 +1326,7 @@ static int isBracketedTitle(struct singleLine *line)
 static int isEntryStart(struct singleLine *line, struct configFileInfo *cfi)
 {
 	return line->type == cfi->entryStart || line->type == LT_OTHER ||
+	    line->type == LT_SUBMENU ||
 	    (cfi->titleBracketed && isBracketedTitle(line));
 }
 
@@ -958,7 +1389,10 @@ static void lineInit(struct singleLine *line)
 	line->indent = NULL;
 	line->elements = NULL;
 	line->numElements = 0;
+	line->elementsAlloced = 0;
 	line->next = NULL;
+	line->lineno = 0;
+	line->text = NULL;
 }
 
 struct singleLine *lineDup(struct singleLine *line)
@@ -967,8 +1401,11 @@ struct singleLine *lineDup(struct singleLine *line)
 
 	newLine->indent = strdup(line->indent);
 	newLine->next = NULL;
+	newLine->lineno = 0;
+	newLine->text = NULL;
 	newLine->type = line->type;
 	newLine->numElements = line->numElements;
+	newLine->elementsAlloced = line->numElements;
 	newLine->elements = malloc(sizeof(*newLine->elements) *
 				   newLine->numElements);
 
@@ -1065,7 +1502,6 @@ static int getNextLine(char **bufPtr, struct singleLine *line,
 	char *end;
 	char *start = *bufPtr;
 	char *chptr;
-	int elementsAlloced = 0;
 	struct lineElement *element;
 	int first = 1;
 
@@ -1083,12 +1519,7 @@ static int getNextLine(char **bufPtr, struct singleLine *line,
 	while (start < end) {
 		/* we know !isspace(*start) */
 
-		if (elementsAlloced == line->numElements) {
-			elementsAlloced += 5;
-			line->elements = realloc(line->elements,
-						 sizeof(*line->elements) *
-						 elementsAlloced);
-		}
+		growElements(line, 1);
 
 		element = line->elements + line->numElements;
 
@@ -1140,27 +1571,20 @@ static int getNextLine(char **bufPtr, struct singleLine *line,
 			 * with no elements (everything stored in the indent
 			 */
 			if (*line->elements[0].item == '#') {
-				char *fullLine;
-				int len;
-
-				len = strlen(line->indent);
-				for (int i = 0; i < line->numElements; i++)
-					len += strlen(line->elements[i].item) +
-					    strlen(line->elements[i].indent);
+				struct strBuf fullLine = { 0 };
 
-				fullLine = malloc(len + 1);
-				strcpy(fullLine, line->indent);
+				strBufAppend(&fullLine, line->indent);
 				free(line->indent);
-				line->indent = fullLine;
 
 				for (int i = 0; i < line->numElements; i++) {
-					strcat(fullLine,
-					       line->elements[i].item);
-					strcat(fullLine,
-					       line->elements[i].indent);
+					strBufAppend(&fullLine,
+						     line->elements[i].item);
+					strBufAppend(&fullLine,
+						     line->elements[i].indent);
 					free(line->elements[i].item);
 					free(line->elements[i].indent);
 				}
+				line->indent = strBufFinish(&fullLine);
 
 				line->type = LT_WHITESPACE;
 				line->numElements = 0;
@@ -1187,19 +1611,10 @@ static int getNextLine(char **bufPtr, struct singleLine *line,
 							numNewElements++;
 						p++;
 					}
-					if (line->numElements +
-					    numNewElements >= elementsAlloced) {
-						elementsAlloced +=
-						    numNewElements + 5;
-						line->elements =
-						    realloc(line->elements,
-							    sizeof(*line->
-								   elements) *
-							    elementsAlloced);
-					}
+					growElements(line, numNewElements);
 
-					for (int j = line->numElements; j > i;
-					     j--) {
+					for (int j = line->numElements - 1;
+					     j > i; j--) {
 						line->elements[j +
 							       numNewElements] =
 						    line->elements[j];
@@ -1224,6 +1639,7 @@ static int getNextLine(char **bufPtr, struct singleLine *line,
 						i++;
 						line->elements[i].item =
 						    strdup(p);
+						p = line->elements[i].item;
 					}
 				}
 			}
@@ -1239,14 +1655,14 @@ static int getNextLine(char **bufPtr, struct singleLine *line,
 			if (!eq)
 				return 0;
 			l = eq - line->elements[1].item;
-			if (eq[1] != 0)
-				numElements++;
+			/* "set blah=" gets an empty value */
+			numElements++;
 			newElements = calloc(numElements,sizeof (*newElements));
 			memcpy(&newElements[0], &line->elements[0],
 			       sizeof (newElements[0]));
 			newElements[1].item =
 				strndup(line->elements[1].item, l);
-			newElements[1].indent = "=";
+			newElements[1].indent = strdup("=");
 			*(eq++) = '\0';
 			newElements[2].item = strdup(eq);
 			free(line->elements[1].item);
@@ -1260,6 +1676,7 @@ static int getNextLine(char **bufPtr, struct singleLine *line,
 			free(line->elements);
 			line->elements = newElements;
 			line->numElements = numElements;
+			line->elementsAlloced = numElements;
 		}
 	}
 
@@ -1275,87 +1692,545 @@ static int isnumber(const char *s)
 	return i;
 }
 
-static struct grubConfig *readConfig(const char *inName,
-				     struct configFileInfo *cfi)
+/* make the title/default a single argument (undoing our parsing) */
+static void joinLineArgs(struct singleLine *line)
 {
-	int in;
-	char *incoming = NULL, *head;
-	int rc;
-	int sawEntry = 0;
-	int movedLine = 0;
-	struct grubConfig *cfg;
-	struct singleLine *last = NULL, *line, *defaultLine = NULL;
-	char *end;
-	struct singleEntry *entry = NULL;
-	int len;
 	char *buf;
+	int len = 0;
 
-	if (inName == NULL) {
-		printf("Could not find bootloader configuration\n");
-		exit(1);
-	} else if (!strcmp(inName, "-")) {
-		in = 0;
-	} else {
-		if ((in = open(inName, O_RDONLY)) < 0) {
-			fprintf(stderr, _("error opening %s for read: %s\n"),
-				inName, strerror(errno));
-			return NULL;
+	for (int i = 1; i < line->numElements; i++) {
+		len += strlen(line->elements[i].item);
+		len += strlen(line->elements[i].indent);
+	}
+	buf = malloc(len + 1);
+	*buf = '\0';
+
+	for (int i = 1; i < line->numElements; i++) {
+		strcat(buf, line->elements[i].item);
+		free(line->elements[i].item);
+
+		if ((i + 1) != line->numElements) {
+			strcat(buf, line->elements[i].indent);
+			free(line->elements[i].indent);
 		}
 	}
 
-	rc = readFile(in, &incoming);
-	close(in);
-	if (rc)
-		return NULL;
+	line->elements[1].indent = line->elements[line->numElements - 1].indent;
+	line->elements[1].item = buf;
+	line->numElements = 2;
+}
 
-	head = incoming;
-	cfg = malloc(sizeof(*cfg));
-	cfg->primaryIndent = strdup("");
-	cfg->secondaryIndent = strdup("\t");
-	cfg->flags = GRUB_CONFIG_NO_DEFAULT;
-	cfg->cfi = cfi;
-	cfg->theLines = NULL;
-	cfg->entries = NULL;
-	cfg->fallbackImage = 0;
-	cfg->isModified = 0;
+/* Strip off any " which may be present; they'll be put back on write. This
+ * is one of the few (the only?) places that grubby canonicalizes the output
+ */
+static void unquoteLineArgs(struct singleLine *line)
+{
+	if (line->numElements >= 2) {
+		int last, len;
 
-	/* copy everything we have */
-	while (*head) {
-		line = malloc(sizeof(*line));
-		lineInit(line);
+		if (isquote(*line->elements[1].item))
+			memmove(line->elements[1].item,
+				line->elements[1].item + 1,
+				strlen(line->elements[1].item + 1) + 1);
 
-		if (getNextLine(&head, line, cfi)) {
-			free(line);
-			/* XXX memory leak of everything in cfg */
-			return NULL;
-		}
+		last = line->numElements - 1;
+		len = strlen(line->elements[last].item) - 1;
+		if (isquote(line->elements[last].item[len]))
+			line->elements[last].item[len] = '\0';
+	}
+}
 
-		if (!sawEntry && line->numElements) {
-			free(cfg->primaryIndent);
-			cfg->primaryIndent = strdup(line->indent);
-		} else if (line->numElements) {
-			free(cfg->secondaryIndent);
-			cfg->secondaryIndent = strdup(line->indent);
+/* Whether a line inside an entry may be left for parseEntry(). Lines which
+ * start or end an entry, or which readConfig() looks at for the whole
+ * config, are always tokenized right away. */
+static int isLazyLine(const char *text, struct configFileInfo *cfi)
+{
+	enum lineType_e type;
+	const char *start, *end;
+
+	for (start = text; *start != '\n' && isspace(*start); start++) ;
+	if (*start == '\n' || *start == '#' ||
+	    (cfi->titleBracketed && *start == '['))
+		return 0;
+
+	for (end = start; *end != '\n' && !isspace(*end) && *end != '='; end++) ;
+	type = getTypeByKeyword(strndupa(start, end - start), cfi);
+
+	if (type == cfi->entryStart)
+		return 0;
+	return !(type & (LT_OTHER | LT_ENTRY_END | LT_GENERIC | LT_DEFAULT |
+			 LT_FALLBACK | LT_SET_VARIABLE | LT_MBMODULE |
+			 LT_HYPER | LT_SUBMENU));
+}
+
+/* Tokenize the lines of an entry which readConfig() skipped in lazy mode,
+ * and redo the multiboot fixups now that the kernel lines are known.
+ * Returns the last line tokenized which has any elements. */
+static struct singleLine *parseEntry(struct grubConfig *cfg,
+				     struct singleEntry *entry)
+{
+	struct singleLine *line, *next, *indented = NULL;
+	int multiboot = 0;
+	int lineno;
+	char *text;
+
+	if (!entry || !entry->unparsed)
+		return NULL;
+
+	for (line = entry->lines; line; line = line->next) {
+		if (line->text) {
+			text = line->text;
+			next = line->next;
+			lineno = line->lineno;
+			getNextLine(&text, line, cfg->cfi);
+			line->next = next;
+			line->lineno = lineno;
+
+			if (line->numElements)
+				indented = line;
+
+			if (line->type == LT_TITLE && line->numElements > 1)
+				joinLineArgs(line);
+			else if (line->type == LT_KERNELARGS &&
+				 cfg->cfi->argsInQuotes)
+				unquoteLineArgs(line);
 		}
 
-		if (isEntryStart(line, cfi) || (cfg->entries && !sawEntry)) {
-			sawEntry = 1;
-			if (!entry) {
-				cfg->entries = malloc(sizeof(*entry));
-				entry = cfg->entries;
-			} else {
-				entry->next = malloc(sizeof(*entry));
-				entry = entry->next;
+		if (iskernel(line->type) && multiboot) {
+			line->type = LT_HYPER;
+		} else if (line->type == LT_MBMODULE) {
+			for (struct singleLine * l = entry->lines; l != line;
+			     l = l->next) {
+				if (l->type == LT_HYPER)
+					break;
+				else if (iskernel(l->type)) {
+					l->type = LT_HYPER;
+					break;
+				}
 			}
-
-			entry->skip = 0;
-			entry->multiboot = 0;
-			entry->lines = NULL;
-			entry->next = NULL;
+			multiboot = 1;
+		} else if (line->type == LT_HYPER) {
+			multiboot = 1;
 		}
+	}
 
-		if (line->type == LT_SET_VARIABLE) {
-			dbgPrintf("found 'set' command (%d elements): ",
+	entry->unparsed = 0;
+	entry->lineTypes = -1;
+	return indented;
+}
+
+struct parseJob {
+	pthread_t thread;
+	int started;		/* whether thread is running */
+	struct grubConfig *cfg;
+	struct singleEntry *first;
+	int count;
+	struct singleLine *indented;
+};
+
+static void *parseEntries(void *arg)
+{
+	struct parseJob *job = arg;
+	struct singleEntry *entry = job->first;
+	struct singleLine *line;
+
+	for (int i = 0; i < job->count; i++, entry = entry->next) {
+		line = parseEntry(job->cfg, entry);
+		if (line)
+			job->indented = line;
+	}
+
+	return NULL;
+}
+
+/* Tokenize the entries readConfig() left for later on several threads.
+ * The lines are already in their place, each thread only fills in those
+ * of its own range of entries. */
+static void parseEntriesParallel(struct grubConfig *cfg, int jobs,
+				 int indentLineno)
+{
+	struct parseJob *jobsArr;
+	struct singleEntry *entry;
+	struct singleLine *indented = NULL;
+	int numEntries = 0, n = 0;
+
+	for (entry = cfg->entries; entry; entry = entry->next)
+		numEntries++;
+	if (jobs > numEntries)
+		jobs = numEntries;
+	if (jobs < 1)
+		return;
+
+	jobsArr = calloc(jobs, sizeof(*jobsArr));
+	entry = cfg->entries;
+	for (int i = 0; i < jobs; i++) {
+		jobsArr[i].cfg = cfg;
+		jobsArr[i].first = entry;
+		jobsArr[i].count = numEntries * (i + 1) / jobs - n;
+		for (int j = 0; j < jobsArr[i].count; j++)
+			entry = entry->next;
+		n += jobsArr[i].count;
+	}
+
+	for (int i = 1; i < jobs; i++) {
+		/* if there's no thread, it's just done below */
+		jobsArr[i].started = !pthread_create(&jobsArr[i].thread,
+						       NULL, parseEntries,
+						       &jobsArr[i]);
+	}
+	parseEntries(&jobsArr[0]);
+	for (int i = 1; i < jobs; i++) {
+		if (jobsArr[i].started)
+			pthread_join(jobsArr[i].thread, NULL);
+		else
+			parseEntries(&jobsArr[i]);
+		if (jobsArr[i].indented)
+			indented = jobsArr[i].indented;
+	}
+	if (!indented)
+		indented = jobsArr[0].indented;
+	free(jobsArr);
+
+	/* the body lines would have set the secondary indent as they were
+	 * read; the last one of them wins if it came after the others */
+	if (indented && indented->lineno > indentLineno) {
+		free(cfg->secondaryIndent);
+		cfg->secondaryIndent = strdup(indented->indent);
+	}
+}
+
+static void addOrigLine(struct grubConfig *cfg, char *text, int *alloced)
+{
+	if (cfg->numOrigLines == *alloced) {
+		*alloced = *alloced ? *alloced * 2 : 64;
+		cfg->origLines = realloc(cfg->origLines,
+					 sizeof(*cfg->origLines) * *alloced);
+	}
+	cfg->origLines[cfg->numOrigLines++] = text;
+}
+
+static void entryFree(struct singleEntry *entry)
+{
+	struct singleLine *line, *next;
+
+	for (line = entry->lines; line; line = next) {
+		next = line->next;
+		lineFree(line);
+	}
+	free(entry->file);
+	free(entry->fileText);
+	free(entry->children);
+	free(entry);
+}
+
+static unsigned int entryIdHash(const char *id)
+{
+	unsigned int hash = 5381;
+
+	while (*id)
+		hash = hash * 33 + (unsigned char)*id++;
+	return hash % ENTRY_ID_BUCKETS;
+}
+
+/* Remember the id of the entry at index, which the config takes ownership
+ * of. Like grub, the first entry with an id wins. */
+static void addEntryId(struct grubConfig *cfg, char *id,
+		       struct singleEntry *entry, int index)
+{
+	struct entryId **bucket, *e;
+
+	if (!cfg->entryIds)
+		cfg->entryIds = calloc(ENTRY_ID_BUCKETS,
+				       sizeof(*cfg->entryIds));
+	bucket = &cfg->entryIds[entryIdHash(id)];
+	for (e = *bucket; e; e = e->next) {
+		if (!strcmp(e->id, id)) {
+			free(id);
+			return;
+		}
+	}
+
+	e = malloc(sizeof(*e));
+	e->id = id;
+	e->entry = entry;
+	e->index = index;
+	e->next = *bucket;
+	*bucket = e;
+}
+
+/* Find the entry with the given grub2 menuentry --id or BLS entry id. */
+static struct singleEntry *findEntryById(struct grubConfig *cfg,
+					 const char *id, int *index)
+{
+	struct entryId *e;
+
+	if (!cfg->entryIds)
+		return NULL;
+
+	for (e = cfg->entryIds[entryIdHash(id)]; e; e = e->next)
+		if (!strcmp(e->id, id))
+			break;
+	if (!e)
+		return NULL;
+
+	if (index)
+		*index = e->index;
+	return e->entry;
+}
+
+/* entry was put in at index, the ones from there on moved down. If it has
+ * the id of one of those, copied from its template, grub finds it first. */
+static void entryIdsInserted(struct grubConfig *cfg, struct singleEntry *entry,
+			     int index)
+{
+	struct singleLine *line;
+	struct entryId *e;
+	char *id;
+
+	for (int i = 0; cfg->entryIds && i < ENTRY_ID_BUCKETS; i++)
+		for (e = cfg->entryIds[i]; e; e = e->next)
+			if (e->index >= index)
+				e->index++;
+
+	line = getEntryLineByType(LT_MENUENTRY, entry);
+	if (!line || !(id = grub2ExtractId(line)))
+		return;
+
+	for (e = cfg->entryIds ? cfg->entryIds[entryIdHash(id)] : NULL; e;
+	     e = e->next)
+		if (!strcmp(e->id, id))
+			break;
+	if (!e) {
+		addEntryId(cfg, id, entry, index);
+		return;
+	}
+	if (e->index > index) {
+		e->entry = entry;
+		e->index = index;
+	}
+	free(id);
+}
+
+/* the entries were reordered, the one at index i is now at newIndex[i] */
+static void entryIdsMoved(struct grubConfig *cfg, const int *newIndex)
+{
+	struct entryId *e;
+
+	if (!cfg->entryIds)
+		return;
+	for (int i = 0; i < ENTRY_ID_BUCKETS; i++)
+		for (e = cfg->entryIds[i]; e; e = e->next)
+			e->index = newIndex[e->index];
+}
+
+/* append an entry to one level of the grub2 menu index */
+static void addMenuItem(struct singleEntry ***items, int *numItems,
+			struct singleEntry *entry)
+{
+	if (!(*numItems % 16))
+		*items = realloc(*items, sizeof(**items) * (*numItems + 16));
+	(*items)[(*numItems)++] = entry;
+}
+
+/* called by readConfigStream() for every entry once it has been read */
+typedef void (*entryHandler) (struct grubConfig * cfg,
+			      struct singleEntry * entry, int index,
+			      void *data);
+
+/* Reads the config. If handleEntry is set, the file is read a line at a time
+ * and each entry is passed to it and freed as soon as the next one starts,
+ * so only one entry is in memory at a time; cfg->entries is left empty and
+ * the default isn't looked up. */
+static struct grubConfig *readConfigStream(const char *inName,
+					   struct configFileInfo *cfi,
+					   entryHandler handleEntry,
+					   void *data)
+{
+	int in;
+	char *incoming = NULL, *head;
+	FILE *stream = NULL;
+	size_t streamAlloced = 0;
+	ssize_t streamLen;
+	int numEntries = 0;
+	int entryIndex = -1;
+	int rc;
+	int sawEntry = 0;
+	int movedLine = 0;
+	struct grubConfig *cfg;
+	struct singleLine *last = NULL, *line, *defaultLine = NULL;
+	char *end;
+	struct singleEntry *entry = NULL;
+	int len;
+	char *lineStart;
+	int lineno = 0;
+	int origLinesAlloced = 0;
+	int indentLineno = 0;
+	int deferParse = 0;
+	int jobs = parseJobs;
+	int buildMenu = !handleEntry && cfi->entryStart == LT_MENUENTRY;
+	struct singleEntry *submenu = NULL;
+	int inMenuEntry = 0;
+
+	if (inName == NULL) {
+		printf("Could not find bootloader configuration\n");
+		exit(1);
+	} else if (!strcmp(inName, "-")) {
+		in = 0;
+	} else {
+		if ((in = open(inName, O_RDONLY)) < 0) {
+			fprintf(stderr, _("error opening %s for read: %s\n"),
+				inName, strerror(errno));
+			return NULL;
+		}
+	}
+
+	if (handleEntry) {
+		stream = fdopen(in, "r");
+		if (!stream) {
+			fprintf(stderr, _("error reading input: %s\n"),
+				strerror(errno));
+			close(in);
+			return NULL;
+		}
+	} else {
+		rc = readFile(in, &incoming);
+		close(in);
+		if (rc)
+			return NULL;
+	}
+
+	/* big configs get their entries tokenized on a thread per CPU */
+	if (!jobs && incoming && strlen(incoming) >= PARALLEL_PARSE_SIZE)
+		jobs = sysconf(_SC_NPROCESSORS_ONLN);
+	deferParse = !lazyParse && !handleEntry && jobs > 1;
+
+	head = incoming;
+	cfg = malloc(sizeof(*cfg));
+	cfg->primaryIndent = strdup("");
+	cfg->secondaryIndent = strdup("\t");
+	cfg->flags = GRUB_CONFIG_NO_DEFAULT;
+	cfg->cfi = cfi;
+	cfg->theLines = NULL;
+	cfg->entries = NULL;
+	cfg->fallbackImage = 0;
+	cfg->isModified = 0;
+	cfg->origText = NULL;
+	cfg->origLines = NULL;
+	cfg->numOrigLines = 0;
+	cfg->kernelOpts = NULL;
+	cfg->envKernelOpts = NULL;
+	cfg->haveEnvKernelOpts = 0;
+	cfg->menu = NULL;
+	cfg->numMenu = 0;
+	cfg->entryIds = NULL;
+
+	/* copy everything we have */
+	while (1) {
+		if (stream) {
+			streamLen = getline(&incoming, &streamAlloced, stream);
+			if (streamLen <= 0)
+				break;
+			if (incoming[streamLen - 1] != '\n') {
+				incoming = realloc(incoming, streamLen + 2);
+				strcpy(incoming + streamLen, "\n");
+			}
+			head = incoming;
+		} else if (!*head) {
+			break;
+		}
+
+		line = malloc(sizeof(*line));
+		lineInit(line);
+
+		lineStart = head;
+
+		/* in lazy mode, only note where the body of an entry is */
+		if ((lazyParse || deferParse) && sawEntry && entry->lines &&
+		    isLazyLine(head, cfi)) {
+			line->text = head;
+			line->lineno = ++lineno;
+			head = strchr(head, '\n') + 1;
+			entry->unparsed++;
+			last->next = line;
+			last = line;
+			movedLine = 0;
+			if (diffOutput)
+				addOrigLine(cfg, lineStart, &origLinesAlloced);
+			continue;
+		}
+
+		if (getNextLine(&head, line, cfi)) {
+			free(line);
+			/* XXX memory leak of everything in cfg */
+			return NULL;
+		}
+		line->lineno = ++lineno;
+
+		/* getNextLine() only terminates the line in place, so the
+		 * original text stays usable for --diff */
+		if (diffOutput)
+			addOrigLine(cfg, lineStart, &origLinesAlloced);
+
+		if (!sawEntry && line->numElements) {
+			free(cfg->primaryIndent);
+			cfg->primaryIndent = strdup(line->indent);
+		} else if (line->numElements) {
+			free(cfg->secondaryIndent);
+			cfg->secondaryIndent = strdup(line->indent);
+			indentLineno = line->lineno;
+		}
+
+		if (isEntryStart(line, cfi) || (cfg->entries && !sawEntry)) {
+			sawEntry = 1;
+			if (handleEntry && entry) {
+				handleEntry(cfg, entry, numEntries++, data);
+				entryFree(entry);
+				entry = NULL;
+			}
+			entryIndex++;
+			if (!entry) {
+				cfg->entries = malloc(sizeof(*entry));
+				entry = cfg->entries;
+			} else {
+				entry->next = malloc(sizeof(*entry));
+				entry = entry->next;
+			}
+
+			entry->skip = 0;
+			entry->multiboot = 0;
+			entry->unparsed = 0;
+			entry->lineTypes = -1;
+			entry->file = NULL;
+			entry->fileText = NULL;
+			entry->parent = submenu;
+			entry->children = NULL;
+			entry->numChildren = 0;
+			entry->lines = NULL;
+			entry->next = NULL;
+
+			/* index the menuentry and submenu blocks the way grub
+			 * numbers them, the other lines don't count */
+			if (buildMenu && (line->type == LT_MENUENTRY ||
+					  line->type == LT_SUBMENU)) {
+				char *id = grub2ExtractId(line);
+
+				if (id)
+					addEntryId(cfg, id, entry, entryIndex);
+				if (submenu)
+					addMenuItem(&submenu->children,
+						    &submenu->numChildren,
+						    entry);
+				else
+					addMenuItem(&cfg->menu, &cfg->numMenu,
+						    entry);
+				if (line->type == LT_SUBMENU)
+					submenu = entry;
+			}
+			inMenuEntry = line->type == LT_MENUENTRY;
+		}
+
+		if (line->type == LT_SET_VARIABLE) {
+			dbgPrintf("found 'set' command (%d elements): ",
 				  line->numElements);
 			dbgPrintf("%s", line->indent);
 			for (int i = 0; i < line->numElements; i++)
@@ -1410,50 +2285,15 @@ static struct grubConfig *readConfig(const char *inName,
 		} else if ((line->type == LT_DEFAULT && cfi->defaultIsUnquoted)
 			   || (line->type == LT_TITLE
 			       && line->numElements > 1)) {
-			/* make the title/default a single argument (undoing
-			 * our parsing) */
-			len = 0;
-			for (int i = 1; i < line->numElements; i++) {
-				len += strlen(line->elements[i].item);
-				len += strlen(line->elements[i].indent);
-			}
-			buf = malloc(len + 1);
-			*buf = '\0';
-
-			for (int i = 1; i < line->numElements; i++) {
-				strcat(buf, line->elements[i].item);
-				free(line->elements[i].item);
-
-				if ((i + 1) != line->numElements) {
-					strcat(buf, line->elements[i].indent);
-					free(line->elements[i].indent);
-				}
-			}
-
-			line->elements[1].indent =
-			    line->elements[line->numElements - 1].indent;
-			line->elements[1].item = buf;
-			line->numElements = 2;
+			joinLineArgs(line);
 		} else if (line->type == LT_MENUENTRY && line->numElements > 3) {
 			/* let --remove-kernel="TITLE=what" work */
-			len = 0;
-			char *extras;
+			struct strBuf titleBuf = { 0 };
+			struct strBuf extras = { 0 };
 			char *title;
 			/* initially unseen value */
 			char quote_char = '\0';
 
-			for (int i = 1; i < line->numElements; i++) {
-				len += strlen(line->elements[i].item);
-				len += strlen(line->elements[i].indent);
-			}
-			buf = malloc(len + 1);
-			*buf = '\0';
-
-			/* allocate mem for extra flags. */
-			extras = malloc(len + 1);
-			*extras = '\0';
-
-			int buf_len = 0;
 			/* get title. */
 			for (int i = 0; i < line->numElements; i++) {
 				if (!strcmp
@@ -1470,27 +2310,25 @@ static struct grubConfig *readConfig(const char *inName,
 
 				len = strlen(title);
 				if (title[len - 1] == quote_char) {
-					memcpy(buf + buf_len, title, len - 1);
-					buf_len += (len - 1);
+					strBufAppendLen(&titleBuf, title,
+							len - 1);
 					break;
 				} else {
-					memcpy(buf + buf_len, title, len);
-					buf_len += len;
-					len = strlen(line->elements[i].indent);
-					memcpy(buf + buf_len, line->elements[i].indent, len);
-					buf_len += len;
+					strBufAppendLen(&titleBuf, title, len);
+					strBufAppend(&titleBuf,
+						     line->elements[i].indent);
 				}
 			}
-			buf[buf_len] = '\0';
 
 			/* get extras */
 			int count = 0;
 			quote_char = '\0';
 			for (int i = 0; i < line->numElements; i++) {
 				if (count >= 2) {
-					strcat(extras, line->elements[i].item);
-					strcat(extras,
-					       line->elements[i].indent);
+					strBufAppend(&extras,
+						     line->elements[i].item);
+					strBufAppend(&extras,
+						     line->elements[i].indent);
 				}
 
 				if (!strcmp
@@ -1515,30 +2353,13 @@ static struct grubConfig *readConfig(const char *inName,
 			}
 			line->elements[1].indent =
 			    line->elements[line->numElements - 2].indent;
-			line->elements[1].item = buf;
+			line->elements[1].item = strBufFinish(&titleBuf);
 			line->elements[2].indent =
-			    line->elements[line->numElements - 2].indent;
-			line->elements[2].item = extras;
+			    strdup(line->elements[line->numElements - 2].indent);
+			line->elements[2].item = strBufFinish(&extras);
 			line->numElements = 3;
 		} else if (line->type == LT_KERNELARGS && cfi->argsInQuotes) {
-			/* Strip off any " which may be present; they'll be
-			 * put back on write. This is one of the few (the
-			 * only?) places that grubby canonicalizes the output
-			 */
-			if (line->numElements >= 2) {
-				int last, len;
-
-				if (isquote(*line->elements[1].item))
-					memmove(line->elements[1].item,
-						line->elements[1].item + 1,
-						strlen(line->elements[1].item +
-						       1) + 1);
-
-				last = line->numElements - 1;
-				len = strlen(line->elements[last].item) - 1;
-				if (isquote(line->elements[last].item[len]))
-					line->elements[last].item[len] = '\0';
-			}
+			unquoteLineArgs(line);
 		}
 
 		if (line->type == LT_DEFAULT && line->numElements == 2) {
@@ -1585,8 +2406,20 @@ static struct grubConfig *readConfig(const char *inName,
 			/* we could have seen this outside of an entry... if
 			 * so, we ignore it like any other line we don't grok
 			 */
-			if (line->type == LT_ENTRY_END && sawEntry)
+			if (line->type == LT_ENTRY_END && sawEntry) {
 				sawEntry = 0;
+				/* a '}' outside of a menuentry closes the
+				 * submenu it's in */
+				if (!inMenuEntry && submenu)
+					submenu = submenu->parent;
+				inMenuEntry = 0;
+			}
+		} else if (stream && !(line->type & (LT_BOOT | LT_LBA))) {
+			/* displayInfoHeader() is all that looks at these */
+			if (line == defaultLine)
+				defaultLine = NULL;
+			lineFree(line);
+			continue;
 		} else {
 			if (!cfg->theLines)
 				cfg->theLines = line;
@@ -1599,7 +2432,33 @@ static struct grubConfig *readConfig(const char *inName,
 		last = line;
 	}
 
-	free(incoming);
+	if (stream) {
+		if (ferror(stream)) {
+			fprintf(stderr, _("error reading input: %s\n"),
+				strerror(errno));
+			fclose(stream);
+			free(incoming);
+			return NULL;
+		}
+		fclose(stream);
+		free(incoming);
+		if (entry) {
+			handleEntry(cfg, entry, numEntries++, data);
+			entryFree(entry);
+		}
+		cfg->entries = NULL;
+		return cfg;
+	}
+
+	if (deferParse)
+		parseEntriesParallel(cfg, jobs, indentLineno);
+
+	/* the original text is still needed for --diff and by the lines
+	 * which haven't been tokenized yet */
+	if (diffOutput || lazyParse)
+		cfg->origText = incoming;
+	else
+		free(incoming);
 
 	dbgPrintf("defaultLine is %s\n", defaultLine ? "set" : "unset");
 	if (defaultLine) {
@@ -1614,17 +2473,9 @@ static struct grubConfig *readConfig(const char *inName,
 				    cfi->getEnv(cfg->cfi, "saved_entry");
 				if (defTitle) {
 					int index = 0;
-					if (isnumber(defTitle)) {
-						index = atoi(defTitle);
-						entry =
-						    findEntryByIndex(cfg,
-								     index);
-					} else {
-						entry =
-						    findEntryByTitle(cfg,
-								     defTitle,
-								     &index);
-					}
+					entry = findEntryBySavedEntry(cfg,
+								      defTitle,
+								      &index);
 					if (entry)
 						cfg->defaultImage = index;
 				}
@@ -1700,12 +2551,7 @@ static struct grubConfig *readConfig(const char *inName,
 		char *defTitle = cfi->getEnv(cfg->cfi, "saved_entry");
 		if (defTitle) {
 			int index = 0;
-			if (isnumber(defTitle)) {
-				index = atoi(defTitle);
-				entry = findEntryByIndex(cfg, index);
-			} else {
-				entry = findEntryByTitle(cfg, defTitle, &index);
-			}
+			entry = findEntryBySavedEntry(cfg, defTitle, &index);
 			if (entry)
 				cfg->defaultImage = index;
 		}
@@ -1716,65 +2562,376 @@ static struct grubConfig *readConfig(const char *inName,
 	return cfg;
 }
 
-static void writeDefault(FILE * out, char *indent,
-			 char *separator, struct grubConfig *cfg)
+/* the entry as it would be written out */
+static char *renderEntry(struct singleEntry *entry, struct configFileInfo *cfi)
 {
-	struct singleEntry *entry;
 	struct singleLine *line;
-	int i;
-
-	if (!cfg->defaultImage && cfg->flags == GRUB_CONFIG_NO_DEFAULT)
-		return;
-
-	if (cfg->defaultImage == DEFAULT_SAVED)
-		fprintf(out, "%sdefault%ssaved\n", indent, separator);
-	else if (cfg->cfi->defaultIsSaved) {
-		fprintf(out, "%sset default=\"${saved_entry}\"\n", indent);
-		if (cfg->defaultImage >= FIRST_ENTRY_INDEX && cfg->cfi->setEnv) {
-			char *title;
-			int trueIndex, currentIndex;
+	char *text = NULL;
+	size_t size;
+	FILE *out;
 
-			trueIndex = 0;
-			currentIndex = 0;
+	out = open_memstream(&text, &size);
+	if (!out)
+		return NULL;
 
-			while ((entry = findEntryByIndex(cfg, currentIndex))) {
-				if (!entry->skip) {
-					if (trueIndex == cfg->defaultImage) {
-						break;
-					}
-					trueIndex++;
-				}
-				currentIndex++;
-			}
-			line = getLineByType(LT_MENUENTRY, entry->lines);
-			if (!line)
-				line = getLineByType(LT_TITLE, entry->lines);
-			if (line) {
-				title = extractTitle(cfg, line);
-				if (title)
-					cfg->cfi->setEnv(cfg->cfi,
-							 "saved_entry", title);
-			}
+	for (line = entry->lines; line; line = line->next) {
+		if (lineWrite(out, line, cfi) == -1) {
+			fclose(out);
+			free(text);
+			return NULL;
 		}
-	} else if (cfg->defaultImage >= FIRST_ENTRY_INDEX) {
-		if (cfg->cfi->defaultIsIndex) {
-			if (cfg->cfi->defaultIsVariable) {
-				fprintf(out, "%sset default=\"%d\"\n", indent,
-					cfg->defaultImage);
-			} else {
-				fprintf(out, "%sdefault%s%d\n", indent,
-					separator, cfg->defaultImage);
-			}
-		} else {
-			int image = cfg->defaultImage;
+	}
 
-			entry = cfg->entries;
-			while (entry && entry->skip)
-				entry = entry->next;
+	if (fclose(out)) {
+		free(text);
+		return NULL;
+	}
+	return text;
+}
 
-			i = 0;
-			while (entry && i < image) {
-				entry = entry->next;
+static struct singleEntry *readBlsEntry(const char *dir, const char *name,
+					struct configFileInfo *cfi)
+{
+	struct singleEntry *entry;
+	struct singleLine *line, *last = NULL;
+	char *path, *incoming, *head;
+	int in, rc;
+
+	if (asprintf(&path, "%s/%s", dir, name) < 0)
+		return NULL;
+
+	in = open(path, O_RDONLY);
+	if (in < 0) {
+		fprintf(stderr, _("error opening %s for read: %s\n"), path,
+			strerror(errno));
+		free(path);
+		return NULL;
+	}
+	free(path);
+
+	rc = readFile(in, &incoming);
+	close(in);
+	if (rc)
+		return NULL;
+
+	entry = calloc(1, sizeof(*entry));
+	entry->lineTypes = -1;
+	entry->file = strdup(name);
+
+	for (head = incoming; *head;) {
+		line = malloc(sizeof(*line));
+		lineInit(line);
+
+		if (getNextLine(&head, line, cfi)) {
+			free(line);
+			free(incoming);
+			entryFree(entry);
+			return NULL;
+		}
+
+		if (line->type == LT_TITLE && line->numElements > 1)
+			joinLineArgs(line);
+
+		if (last)
+			last->next = line;
+		else
+			entry->lines = line;
+		last = line;
+	}
+	free(incoming);
+
+	entry->fileText = renderEntry(entry, cfi);
+	return entry;
+}
+
+struct blsJob {
+	pthread_t thread;
+	int started;		/* whether thread is running */
+	const char *dir;
+	char **names;
+	struct singleEntry **entries;
+	int count;
+	struct configFileInfo *cfi;
+	int failed;
+};
+
+static void *readBlsEntries(void *arg)
+{
+	struct blsJob *job = arg;
+
+	for (int i = 0; i < job->count; i++) {
+		job->entries[i] = readBlsEntry(job->dir, job->names[i],
+					       job->cfi);
+		if (!job->entries[i])
+			job->failed = 1;
+	}
+
+	return NULL;
+}
+
+/* newest version first, the way the BootLoaderSpec orders the entries */
+static int blsNameCompare(const void *a, const void *b)
+{
+	return nvr_rpmvercmp(*(char *const *)b, *(char *const *)a);
+}
+
+/* the id of the entry is the name of its file without .conf */
+static char *blsEntryId(struct singleEntry *entry)
+{
+	size_t len;
+
+	if (!entry || !entry->file)
+		return NULL;
+
+	len = strlen(entry->file);
+	if (len > 5 && !strcmp(entry->file + len - 5, ".conf"))
+		len -= 5;
+	return strndup(entry->file, len);
+}
+
+/* Read the BootLoaderSpec entries in dir. Each *.conf file is an entry of
+ * its own, so they're all read and tokenized independently, on a thread
+ * per CPU if there are a lot of them. */
+static struct grubConfig *readBlsConfig(const char *dir,
+					struct configFileInfo *cfi)
+{
+	struct grubConfig *cfg;
+	struct singleEntry **entries, **next;
+	struct blsJob *jobs;
+	struct dirent *ent;
+	char **names = NULL;
+	int numNames = 0, namesAlloced = 0;
+	int numJobs = parseJobs;
+	int failed = 0, n = 0;
+	char *savedEntry;
+	DIR *d;
+
+	d = opendir(dir);
+	if (!d) {
+		fprintf(stderr, _("error opening %s for read: %s\n"), dir,
+			strerror(errno));
+		return NULL;
+	}
+
+	while ((ent = readdir(d))) {
+		size_t len = strlen(ent->d_name);
+
+		if (ent->d_name[0] == '.' || len <= 5 ||
+		    strcmp(ent->d_name + len - 5, ".conf"))
+			continue;
+		if (ent->d_type != DT_REG && ent->d_type != DT_LNK &&
+		    ent->d_type != DT_UNKNOWN)
+			continue;
+
+		if (numNames == namesAlloced) {
+			namesAlloced = namesAlloced ? namesAlloced * 2 : 16;
+			names = realloc(names, sizeof(*names) * namesAlloced);
+		}
+		names[numNames++] = strdup(ent->d_name);
+	}
+	closedir(d);
+
+	qsort(names, numNames, sizeof(*names), blsNameCompare);
+
+	if (!numJobs && numNames >= PARALLEL_PARSE_FILES)
+		numJobs = sysconf(_SC_NPROCESSORS_ONLN);
+	if (numJobs > numNames)
+		numJobs = numNames;
+	if (numJobs < 1)
+		numJobs = 1;
+
+	entries = calloc(numNames + 1, sizeof(*entries));
+	jobs = calloc(numJobs, sizeof(*jobs));
+	for (int i = 0; i < numJobs; i++) {
+		jobs[i].dir = dir;
+		jobs[i].cfi = cfi;
+		jobs[i].names = names + n;
+		jobs[i].entries = entries + n;
+		jobs[i].count = numNames * (i + 1) / numJobs - n;
+		n += jobs[i].count;
+	}
+
+	for (int i = 1; i < numJobs; i++) {
+		/* if there's no thread, it's just done below */
+		jobs[i].started = !pthread_create(&jobs[i].thread, NULL,
+						  readBlsEntries, &jobs[i]);
+	}
+	readBlsEntries(&jobs[0]);
+	failed = jobs[0].failed;
+	for (int i = 1; i < numJobs; i++) {
+		if (jobs[i].started)
+			pthread_join(jobs[i].thread, NULL);
+		else
+			readBlsEntries(&jobs[i]);
+		failed |= jobs[i].failed;
+	}
+	free(jobs);
+
+	for (int i = 0; i < numNames; i++)
+		free(names[i]);
+	free(names);
+
+	if (failed) {
+		for (int i = 0; i < numNames; i++)
+			if (entries[i])
+				entryFree(entries[i]);
+		free(entries);
+		return NULL;
+	}
+
+	cfg = malloc(sizeof(*cfg));
+	cfg->primaryIndent = strdup("");
+	cfg->secondaryIndent = strdup("");
+	cfg->flags = 0;
+	cfg->cfi = cfi;
+	cfg->theLines = NULL;
+	cfg->entries = NULL;
+	cfg->defaultImage = FIRST_ENTRY_INDEX;
+	cfg->fallbackImage = -1;
+	cfg->isModified = 0;
+	cfg->origText = NULL;
+	cfg->origLines = NULL;
+	cfg->numOrigLines = 0;
+	cfg->kernelOpts = NULL;
+	cfg->envKernelOpts = NULL;
+	cfg->haveEnvKernelOpts = 0;
+	cfg->menu = NULL;
+	cfg->numMenu = 0;
+	cfg->entryIds = NULL;
+
+	next = &cfg->entries;
+	for (int i = 0; i < numNames; i++) {
+		*next = entries[i];
+		next = &entries[i]->next;
+		addEntryId(cfg, blsEntryId(entries[i]), entries[i], i);
+	}
+	free(entries);
+
+	savedEntry = cfi->getEnv ? cfi->getEnv(cfi, "saved_entry") : NULL;
+	if (savedEntry && isnumber(savedEntry)) {
+		if (findEntryByIndex(cfg, atoi(savedEntry)))
+			cfg->defaultImage = atoi(savedEntry);
+	} else if (savedEntry) {
+		int i;
+
+		if (findEntryById(cfg, savedEntry, &i))
+			cfg->defaultImage = i;
+	}
+
+	return cfg;
+}
+
+static struct grubConfig *readConfig(const char *inName,
+				     struct configFileInfo *cfi)
+{
+	if (cfi->entryPerFile)
+		return readBlsConfig(inName, cfi);
+	return readConfigStream(inName, cfi, NULL, NULL);
+}
+
+/* grub only finds an entry in a submenu by its full path, "submenu>entry".
+ * Untitled submenus are given by their position instead. */
+static char *menuEntryPath(struct grubConfig *cfg, struct singleEntry *entry)
+{
+	struct singleEntry **items = cfg->menu;
+	int numItems = cfg->numMenu;
+	struct singleLine *line;
+	char *title, *parent, *path;
+	int i;
+
+	line = getEntryLineByType(LT_MENUENTRY | LT_SUBMENU, entry);
+	title = line ? grub2ExtractTitle(line) : NULL;
+	if (!title) {
+		if (entry->parent) {
+			items = entry->parent->children;
+			numItems = entry->parent->numChildren;
+		}
+		for (i = 0; i < numItems && items[i] != entry; i++) ;
+		if (i == numItems || asprintf(&title, "%d", i) < 0)
+			return NULL;
+	}
+	if (!entry->parent)
+		return title;
+
+	parent = menuEntryPath(cfg, entry->parent);
+	if (!parent || asprintf(&path, "%s>%s", parent, title) < 0)
+		path = NULL;
+	free(parent);
+	free(title);
+	return path;
+}
+
+static void writeDefault(FILE * out, char *indent,
+			 char *separator, struct grubConfig *cfg)
+{
+	struct singleEntry *entry;
+	struct singleLine *line;
+	int i;
+
+	if (!cfg->defaultImage && cfg->flags == GRUB_CONFIG_NO_DEFAULT)
+		return;
+
+	if (cfg->defaultImage == DEFAULT_SAVED)
+		fprintf(out, "%sdefault%ssaved\n", indent, separator);
+	else if (cfg->cfi->defaultIsSaved) {
+		fprintf(out, "%sset default=\"${saved_entry}\"\n", indent);
+		if (cfg->defaultImage >= FIRST_ENTRY_INDEX && cfg->cfi->setEnv
+		    && !diffOutput) {
+			char *title, *savedEntry;
+			int trueIndex, currentIndex;
+
+			trueIndex = 0;
+			currentIndex = 0;
+
+			while ((entry = findEntryByIndex(cfg, currentIndex))) {
+				if (!entry->skip) {
+					if (trueIndex == cfg->defaultImage) {
+						break;
+					}
+					trueIndex++;
+				}
+				currentIndex++;
+			}
+			line = getEntryLineByType(LT_MENUENTRY, entry);
+			if (!line)
+				line = getEntryLineByType(LT_TITLE, entry);
+			/* leave a saved_entry which already names the entry,
+			 * by its id for instance */
+			savedEntry = cfg->cfi->getEnv ?
+			    cfg->cfi->getEnv(cfg->cfi, "saved_entry") : NULL;
+			i = 0;
+			if (savedEntry && entry && !isnumber(savedEntry) &&
+			    findEntryBySavedEntry(cfg, savedEntry, &i) == entry)
+				line = NULL;
+			if (line) {
+				if (entry->parent)
+					title = menuEntryPath(cfg, entry);
+				else
+					title = extractTitle(cfg, line);
+				if (title)
+					cfg->cfi->setEnv(cfg->cfi,
+							 "saved_entry", title);
+			}
+		}
+	} else if (cfg->defaultImage >= FIRST_ENTRY_INDEX) {
+		if (cfg->cfi->defaultIsIndex) {
+			if (cfg->cfi->defaultIsVariable) {
+				fprintf(out, "%sset default=\"%d\"\n", indent,
+					cfg->defaultImage);
+			} else {
+				fprintf(out, "%sdefault%s%d\n", indent,
+					separator, cfg->defaultImage);
+			}
+		} else {
+			int image = cfg->defaultImage;
+
+			entry = cfg->entries;
+			while (entry && entry->skip)
+				entry = entry->next;
+
+			i = 0;
+			while (entry && i < image) {
+				entry = entry->next;
 
 				while (entry && entry->skip)
 					entry = entry->next;
@@ -1784,7 +2941,7 @@ static void writeDefault(FILE * out, char *indent,
 			if (!entry)
 				return;
 
-			line = getLineByType(LT_TITLE, entry->lines);
+			line = getEntryLineByType(LT_TITLE, entry);
 
 			if (line && line->numElements >= 2)
 				fprintf(out, "%sdefault%s%s\n", indent,
@@ -1802,75 +2959,48 @@ static void writeDefault(FILE * out, char *indent,
 	}
 }
 
-static int writeConfig(struct grubConfig *cfg, char *outName,
-		       const char *prefix)
+/* where each chunk of rendered output came from, for --diff */
+struct lineOrigin {
+	long offset;
+	int lineno;
+};
+
+struct outputMap {
+	struct lineOrigin *origins;
+	int numOrigins;
+	int alloced;
+};
+
+static void mapLine(struct outputMap *map, FILE * out, int lineno)
+{
+	if (!map)
+		return;
+
+	if (map->numOrigins == map->alloced) {
+		map->alloced = map->alloced ? map->alloced * 2 : 64;
+		map->origins = realloc(map->origins,
+				       sizeof(*map->origins) * map->alloced);
+	}
+	fflush(out);
+	map->origins[map->numOrigins].offset = ftell(out);
+	map->origins[map->numOrigins].lineno = lineno;
+	map->numOrigins++;
+}
+
+/* render the whole config to out; if map isn't NULL, note the original
+ * line number of everything written */
+static int writeConfigLines(FILE * out, struct grubConfig *cfg,
+			    struct outputMap *map)
 {
-	FILE *out = NULL;
 	struct singleLine *line;
 	struct singleEntry *entry;
-	char *tmpOutName;
 	int needs = MAIN_DEFAULT;
-	struct stat sb;
 	int i;
-	int rc = 0;
-
-	if (!strcmp(outName, "-")) {
-		out = stdout;
-		tmpOutName = NULL;
-	} else {
-		if (!lstat(outName, &sb) && S_ISLNK(sb.st_mode)) {
-			char *buf;
-			int len = 256;
-			int rc;
-
-			/* most likely the symlink is relative, so change our
-			   directory to the dir of the symlink */
-			char *dir = strdupa(outName);
-			rc = chdir(dirname(dir));
-			do {
-				buf = alloca(len + 1);
-				rc = readlink(basename(outName), buf, len);
-				if (rc == len)
-					len += 256;
-			} while (rc == len);
-
-			if (rc < 0) {
-				fprintf(stderr,
-					_
-					("grubby: error readlink link %s: %s\n"),
-					outName, strerror(errno));
-				return 1;
-			}
-
-			outName = buf;
-			outName[rc] = '\0';
-		}
-
-		tmpOutName = alloca(strlen(outName) + 2);
-		sprintf(tmpOutName, "%s-", outName);
-		out = fopen(tmpOutName, "w");
-		if (!out) {
-			fprintf(stderr, _("grubby: error creating %s: %s\n"),
-				tmpOutName, strerror(errno));
-			return 1;
-		}
-
-		if (!stat(outName, &sb)) {
-			if (chmod(tmpOutName, sb.st_mode & ~(S_IFMT))) {
-				fprintf(stderr,
-					_
-					("grubby: error setting perms on %s: %s\n"),
-					tmpOutName, strerror(errno));
-				fclose(out);
-				unlink(tmpOutName);
-				return 1;
-			}
-		}
-	}
 
 	line = cfg->theLines;
 	struct keywordTypes *defaultKw = getKeywordByType(LT_DEFAULT, cfg->cfi);
 	while (line) {
+		mapLine(map, out, line->lineno);
 		if (line->type == LT_SET_VARIABLE && defaultKw &&
 		    line->numElements == 3 &&
 		    !strcmp(line->elements[1].item, defaultKw->key) &&
@@ -1889,20 +3019,15 @@ static int writeConfig(struct grubConfig *cfg, char *outName,
 					line->elements[0].indent,
 					cfg->fallbackImage);
 		} else {
-			if (lineWrite(out, line, cfg->cfi) == -1) {
-				fprintf(stderr,
-					_("grubby: error writing %s: %s\n"),
-					tmpOutName, strerror(errno));
-				fclose(out);
-				unlink(tmpOutName);
-				return 1;
-			}
+			if (lineWrite(out, line, cfg->cfi) == -1)
+				return -1;
 		}
 
 		line = line->next;
 	}
 
 	if (needs & MAIN_DEFAULT) {
+		mapLine(map, out, 0);
 		writeDefault(out, cfg->primaryIndent, "=", cfg);
 		needs &= ~MAIN_DEFAULT;
 	}
@@ -1914,53 +3039,914 @@ static int writeConfig(struct grubConfig *cfg, char *outName,
 
 		line = entry->lines;
 		while (line) {
-			if (lineWrite(out, line, cfg->cfi) == -1) {
-				fprintf(stderr,
-					_("grubby: error writing %s: %s\n"),
-					tmpOutName, strerror(errno));
-				fclose(out);
-				unlink(tmpOutName);
-				return 1;
-			}
+			mapLine(map, out, line->lineno);
+			if (lineWrite(out, line, cfg->cfi) == -1)
+				return -1;
 			line = line->next;
 		}
 	}
 
-	if (tmpOutName) {
-		/* write userspace buffers */
-		if (fflush(out))
-			rc = 1;
-
-		/* purge the write-back cache with fsync() */
-		if (fsync(fileno(out)))
-			rc = 1;
+	mapLine(map, out, 0);
+	return 0;
+}
+
+/* Files written by one grubby invocation (the config file and, for grub2,
+ * the environment block) are staged next to their destination and only
+ * renamed into place once all of them have been written and synced. Files
+ * to be removed are only unlinked then as well. */
+struct stagedFile {
+	char *path;		/* destination */
+	char *tmpPath;		/* new contents, NULL to remove path */
+	char *oldPath;		/* link to the replaced file, for rollback */
+	int created;		/* path didn't exist, unlink it on rollback */
+	int anonymous;		/* O_TMPFILE, not linked in until commit */
+	FILE *out;
+};
+
+static struct stagedFile *stagedFiles = NULL;
+static int numStagedFiles = 0;
+
+static void beginCommit(void)
+{
+	stagingFiles = 1;
+}
+
+/* if path is a symlink, return what it points to (relative to the
+ * directory of the link) so that we replace the target, not the link */
+static char *resolveLink(const char *path)
+{
+	struct stat sb;
+	char *buf = NULL;
+	int len = 256;
+	int rc;
+
+	if (lstat(path, &sb) || !S_ISLNK(sb.st_mode))
+		return strdup(path);
+
+	do {
+		buf = realloc(buf, len + 1);
+		rc = readlink(path, buf, len);
+		if (rc == len)
+			len += 256;
+	} while (rc == len);
+
+	if (rc < 0) {
+		fprintf(stderr, _("grubby: error readlink link %s: %s\n"),
+			path, strerror(errno));
+		free(buf);
+		return NULL;
+	}
+	buf[rc] = '\0';
+
+	if (*buf != '/' && strchr(path, '/')) {
+		char *target;
+		char *dir = dirname(strdupa(path));
+
+		rc = asprintf(&target, "%s/%s", dir, buf);
+		free(buf);
+		return rc < 0 ? NULL : target;
+	}
+
+	return buf;
+}
+
+static struct stagedFile *findStagedFile(const char *path)
+{
+	for (int i = 0; i < numStagedFiles; i++)
+		if (!strcmp(stagedFiles[i].path, path))
+			return &stagedFiles[i];
+	return NULL;
+}
+
+/* where the current contents of path are, taking staged files into
+ * account */
+static const char *stagedPath(const char *path)
+{
+	struct stagedFile *sf;
+	char *target = resolveLink(path);
+
+	if (!target)
+		return path;
+
+	sf = findStagedFile(target);
+	free(target);
+	if (sf && sf->out) {
+		static char procPath[32];
+
+		fflush(sf->out);
+		if (!sf->anonymous)
+			return sf->tmpPath;
+		snprintf(procPath, sizeof(procPath), "/proc/self/fd/%d",
+			 fileno(sf->out));
+		return procPath;
+	}
+	return path;
+}
+
+/* Open an unnamed file in the destination directory, which is linked in
+ * as tmpPath only once it is complete, so nothing is left behind if we're
+ * killed half way. Linking it needs /proc; vfat can't do it at all. */
+static FILE *openAnonymous(const char *path, mode_t mode)
+{
+#ifdef O_TMPFILE
+	char *dir = dirname(strdupa(path));
+	FILE *f;
+	int fd;
+
+	if (access("/proc/self/fd", X_OK))
+		return NULL;
+
+	fd = open(dir, O_TMPFILE | O_WRONLY, mode);
+	if (fd < 0)
+		return NULL;
+
+	/* O_TMPFILE applies the umask, the permission bits must match */
+	if (fchmod(fd, mode) || !(f = fdopen(fd, "w"))) {
+		close(fd);
+		return NULL;
+	}
+	return f;
+#else
+	return NULL;
+#endif
+}
+
+/* returns a stream for the new contents of path; staging the same file
+ * again starts it over */
+static FILE *stageFile(const char *path)
+{
+	struct stagedFile *sf;
+	struct stat sb;
+	char *target;
+
+	target = resolveLink(path);
+	if (!target)
+		return NULL;
+
+	sf = findStagedFile(target);
+	if (sf && !sf->out) {
+		fprintf(stderr, _("grubby: %s is being removed\n"), target);
+		free(target);
+		return NULL;
+	} else if (sf) {
+		free(target);
+		rewind(sf->out);
+		if (ftruncate(fileno(sf->out), 0)) {
+			fprintf(stderr, _("grubby: error truncating %s: %s\n"),
+				sf->tmpPath, strerror(errno));
+			return NULL;
+		}
+		return sf->out;
+	}
+
+	stagedFiles = realloc(stagedFiles,
+			      sizeof(*stagedFiles) * (numStagedFiles + 1));
+	sf = &stagedFiles[numStagedFiles];
+	sf->path = target;
+	sf->oldPath = NULL;
+	sf->created = 0;
+	if (asprintf(&sf->tmpPath, "%s-", target) < 0)
+		return NULL;
+
+	/* a new file gets what fopen() would have given it */
+	if (stat(target, &sb)) {
+		mode_t mask = umask(0);
+
+		umask(mask);
+		sb.st_mode = 0666 & ~mask;
+	}
+	sb.st_mode &= ~S_IFMT;
+
+	sf->out = openAnonymous(target, sb.st_mode);
+	sf->anonymous = sf->out != NULL;
+	if (!sf->out) {
+		sf->out = fopen(sf->tmpPath, "w");
+		if (!sf->out) {
+			fprintf(stderr, _("grubby: error creating %s: %s\n"),
+				sf->tmpPath, strerror(errno));
+			free(sf->tmpPath);
+			free(sf->path);
+			return NULL;
+		}
+	}
+	numStagedFiles++;
+
+	if (!sf->anonymous && fchmod(fileno(sf->out), sb.st_mode)) {
+		fprintf(stderr, _("grubby: error setting perms on %s: %s\n"),
+			sf->tmpPath, strerror(errno));
+		return NULL;
+	}
+
+	return sf->out;
+}
+
+/* remove path when the commit is finished */
+static int stageRemoval(const char *path)
+{
+	struct stagedFile *sf;
+
+	if (findStagedFile(path)) {
+		fprintf(stderr, _("grubby: %s is being replaced\n"), path);
+		return 1;
+	}
+
+	stagedFiles = realloc(stagedFiles,
+			      sizeof(*stagedFiles) * (numStagedFiles + 1));
+	sf = &stagedFiles[numStagedFiles++];
+	sf->path = strdup(path);
+	sf->tmpPath = NULL;
+	sf->oldPath = NULL;
+	sf->created = 0;
+	sf->anonymous = 0;
+	sf->out = NULL;
+
+	return 0;
+}
+
+static void freeStagedFiles(void)
+{
+	for (int i = 0; i < numStagedFiles; i++) {
+		if (stagedFiles[i].out)
+			fclose(stagedFiles[i].out);
+		free(stagedFiles[i].path);
+		free(stagedFiles[i].tmpPath);
+		free(stagedFiles[i].oldPath);
+	}
+	free(stagedFiles);
+	stagedFiles = NULL;
+	numStagedFiles = 0;
+	stagingFiles = 0;
+}
+
+/* throw away everything staged since beginCommit() */
+static void abortCommit(void)
+{
+	for (int i = 0; i < numStagedFiles; i++) {
+		if (stagedFiles[i].out) {
+			fclose(stagedFiles[i].out);
+			stagedFiles[i].out = NULL;
+		}
+		if (!stagedFiles[i].anonymous && stagedFiles[i].tmpPath)
+			unlink(stagedFiles[i].tmpPath);
+	}
+	freeStagedFiles();
+}
+
+/* Sync every staged file, rename them all into place and then fsync() each
+ * directory involved once. If a rename fails, the files which were already
+ * replaced are put back and the ones which were created are removed. A
+ * path-grubby-old link left behind by a run which was killed half way is
+ * replaced the next time path is committed. */
+static int finishCommit(void)
+{
+	struct stagedFile tmp;
+	int rc = 0;
+	int i, j;
+
+	if (fflush(stdout))
+		rc = 1;
+
+	for (i = 0; i < numStagedFiles && !rc; i++) {
+		struct stagedFile *sf = &stagedFiles[i];
+
+		if (!sf->out)
+			continue;
+
+		/* write userspace buffers and purge the write-back cache. The
+		 * mode of an unnamed file was set before anything was written,
+		 * so only its data needs syncing. */
+		if (fflush(sf->out))
+			rc = 1;
+		else if (sf->anonymous)
+			rc = fdatasync(fileno(sf->out)) ? 1 : 0;
+		else
+			rc = fsync(fileno(sf->out)) ? 1 : 0;
+
+		if (!rc && sf->anonymous) {
+			char procPath[32];
+
+			snprintf(procPath, sizeof(procPath), "/proc/self/fd/%d",
+				 fileno(sf->out));
+			unlink(sf->tmpPath);
+			if (linkat(AT_FDCWD, procPath, AT_FDCWD, sf->tmpPath,
+				   AT_SYMLINK_FOLLOW))
+				rc = 1;
+			else
+				sf->anonymous = 0;
+		}
+
+		if (fclose(sf->out))
+			rc = 1;
+		sf->out = NULL;
+	}
+	if (rc) {
+		fprintf(stderr, _("grubby: error flushing data: %m\n"));
+		abortCommit();
+		return 1;
+	}
+
+	/* keep a link to what each file is replacing, so it can be restored
+	 * if a later rename fails; a file which doesn't exist yet just gets
+	 * removed again. Not every filesystem can link (vfat), so rename the
+	 * files which can't be restored last. */
+	for (i = 0, j = 0; i < numStagedFiles; i++) {
+		struct stagedFile *sf = &stagedFiles[i];
+
+		if (asprintf(&sf->oldPath, "%s-grubby-old", sf->path) < 0) {
+			sf->oldPath = NULL;
+			continue;
+		}
+		unlink(sf->oldPath);
+		if (link(sf->path, sf->oldPath)) {
+			sf->created = errno == ENOENT && sf->tmpPath;
+			free(sf->oldPath);
+			sf->oldPath = NULL;
+			if (!sf->created)
+				continue;
+		}
+
+		tmp = stagedFiles[j];
+		stagedFiles[j++] = *sf;
+		*sf = tmp;
+	}
+
+	for (i = 0; i < numStagedFiles; i++) {
+		if (!stagedFiles[i].tmpPath) {
+			if (unlink(stagedFiles[i].path) && errno != ENOENT) {
+				rc = 1;
+				break;
+			}
+		} else if (rename(stagedFiles[i].tmpPath,
+				  stagedFiles[i].path)) {
+			rc = 1;
+			break;
+		}
+	}
+
+	if (rc) {
+		if (stagedFiles[i].tmpPath)
+			fprintf(stderr, _("grubby: error renaming %s: %m\n"),
+				stagedFiles[i].tmpPath);
+		else
+			fprintf(stderr, _("grubby: error removing %s: %m\n"),
+				stagedFiles[i].path);
+		for (j = 0; j < i; j++) {
+			if (stagedFiles[j].created)
+				unlink(stagedFiles[j].path);
+			else if (stagedFiles[j].oldPath &&
+				 !rename(stagedFiles[j].oldPath,
+					 stagedFiles[j].path)) {
+				free(stagedFiles[j].oldPath);
+				stagedFiles[j].oldPath = NULL;
+			}
+		}
+		for (; i < numStagedFiles; i++)
+			if (stagedFiles[i].tmpPath)
+				unlink(stagedFiles[i].tmpPath);
+	}
+
+	for (i = 0; i < numStagedFiles; i++) {
+		if (stagedFiles[i].oldPath)
+			unlink(stagedFiles[i].oldPath);
+	}
+
+	/* fsync() the destination directories after rename */
+	for (i = 0; i < numStagedFiles; i++) {
+		char *dir = dirname(strdupa(stagedFiles[i].path));
+		int dirfd;
+
+		for (j = 0; j < i; j++)
+			if (!strcmp(dir, dirname(strdupa(stagedFiles[j].path))))
+				break;
+		if (j < i)
+			continue;
+
+		dirfd = open(dir, O_RDONLY);
+		if (dirfd < 0 || fsync(dirfd)) {
+			fprintf(stderr,
+				_("grubby: error flushing data: %m\n"));
+			rc = 1;
+		}
+		if (dirfd >= 0)
+			close(dirfd);
+	}
+
+	freeStagedFiles();
+	return rc;
+}
+
+/* the value of the kernelopts variable, as it's going to be written; the
+ * environment block is only asked once */
+static const char *getKernelOpts(struct grubConfig *cfg)
+{
+	const char *value;
+
+	if (cfg->kernelOpts)
+		return cfg->kernelOpts;
+	if (!cfg->haveEnvKernelOpts) {
+		cfg->haveEnvKernelOpts = 1;
+		value = cfg->cfi->getEnv ?
+		    cfg->cfi->getEnv(cfg->cfi, KERNELOPTS) : NULL;
+		if (value)
+			cfg->envKernelOpts = strdup(value);
+	}
+	return cfg->envKernelOpts;
+}
+
+/* write the new value of the kernelopts variable, if there is one */
+static int writeKernelOpts(struct grubConfig *cfg)
+{
+	char *value;
+	int rc;
+
+	if (!cfg->kernelOpts)
+		return 0;
+
+	/* setEnv() unquotes the value in place */
+	value = strdup(cfg->kernelOpts);
+	rc = cfg->cfi->setEnv(cfg->cfi, KERNELOPTS, value);
+	free(value);
+	return rc;
+}
+
+/* if only $kernelopts changed, the config itself usually didn't */
+static int configUnchanged(struct grubConfig *cfg, const char *path)
+{
+	char *text = NULL, *old = NULL;
+	size_t size;
+	FILE *out;
+	int fd, rc;
+
+	out = open_memstream(&text, &size);
+	if (!out)
+		return 0;
+	rc = writeConfigLines(out, cfg, NULL);
+	if (fclose(out) || rc == -1) {
+		free(text);
+		return 0;
+	}
+
+	fd = open(path, O_RDONLY);
+	if (fd >= 0) {
+		rc = readFile(fd, &old);
+		close(fd);
+		if (!rc)
+			rc = strcmp(old, text) ? 0 : 1;
+		else
+			rc = 0;
+	} else {
+		rc = 0;
+	}
+
+	free(old);
+	free(text);
+	return rc;
+}
+
+static int writeConfig(struct grubConfig *cfg, char *outName,
+		       const char *prefix)
+{
+	FILE *out;
+
+	beginCommit();
+
+	if (writeKernelOpts(cfg)) {
+		abortCommit();
+		return 1;
+	}
+
+	if (!strcmp(outName, "-")) {
+		out = stdout;
+	} else if (cfg->kernelOpts && configUnchanged(cfg, outName)) {
+		return finishCommit();
+	} else {
+		out = stageFile(outName);
+		if (!out) {
+			abortCommit();
+			return 1;
+		}
+	}
+
+	if (writeConfigLines(out, cfg, NULL) == -1) {
+		fprintf(stderr, _("grubby: error writing %s: %s\n"),
+			outName, strerror(errno));
+		abortCommit();
+		return 1;
+	}
+
+	return finishCommit();
+}
+
+/* first word of /etc/machine-id, or of the entry's machine-id line */
+static char *blsMachineId(struct singleEntry *entry)
+{
+	struct singleLine *line;
+	char buf[64];
+	FILE *f;
+
+	for (line = entry->lines; line; line = line->next)
+		if (line->numElements == 2 &&
+		    !strcmp(line->elements[0].item, "machine-id"))
+			return strdup(line->elements[1].item);
+
+	f = fopen("/etc/machine-id", "r");
+	if (!f)
+		return NULL;
+	if (fscanf(f, "%63s", buf) != 1) {
+		fclose(f);
+		return NULL;
+	}
+	fclose(f);
+	return strdup(buf);
+}
+
+/* Pick the file name for a new entry, [machine-id-]version.conf, where the
+ * version is taken from the kernel's name. A version line copied from the
+ * template is updated to match. */
+static void blsNameEntry(struct grubConfig *cfg, struct singleEntry *new)
+{
+	struct singleEntry *entry;
+	struct singleLine *line;
+	char *version, *machineId, *base, *name = NULL;
+	int n = 0;
+
+	line = getEntryLineByType(LT_KERNEL, new);
+	if (line && line->numElements >= 2) {
+		version = strrchr(line->elements[1].item, '/');
+		version = version ? version + 1 : line->elements[1].item;
+		if (!strncmp(version, "vmlinuz-", 8) && version[8])
+			version += 8;
+	} else {
+		version = "linux";
+	}
+
+	for (line = new->lines; line; line = line->next) {
+		if (line->numElements == 2 &&
+		    !strcmp(line->elements[0].item, "version")) {
+			free(line->elements[1].item);
+			line->elements[1].item = strdup(version);
+		}
+	}
+
+	machineId = blsMachineId(new);
+	if (asprintf(&base, "%s%s%s", machineId ? machineId : "",
+		     machineId ? "-" : "", version) < 0)
+		base = NULL;
+	free(machineId);
+	if (!base)
+		return;
+
+	/* the same kernel may be added more than once */
+	do {
+		free(name);
+		if ((n ? asprintf(&name, "%s~%d.conf", base, n) :
+		     asprintf(&name, "%s.conf", base)) < 0) {
+			name = NULL;
+			break;
+		}
+		n++;
+
+		for (entry = cfg->entries; entry; entry = entry->next)
+			if (entry->file && !strcmp(entry->file, name))
+				break;
+	} while (entry);
+
+	free(base);
+	new->file = name;
+}
+
+/* point saved_entry at the default entry, if it doesn't already */
+static int blsWriteDefault(struct grubConfig *cfg)
+{
+	struct configFileInfo *cfi = cfg->cfi;
+	struct singleEntry *entry;
+	char *id, *savedEntry;
+	int i = 0, rc = 0;
+
+	if (cfg->defaultImage < FIRST_ENTRY_INDEX || !cfi->setEnv)
+		return 0;
+
+	for (entry = cfg->entries; entry; entry = entry->next) {
+		if (entry->skip)
+			continue;
+		if (i++ == cfg->defaultImage)
+			break;
+	}
+
+	id = blsEntryId(entry);
+	if (!id)
+		return 0;
+
+	/* without saved_entry the first entry is the default already */
+	savedEntry = cfi->getEnv ? cfi->getEnv(cfi, "saved_entry") : NULL;
+	if (savedEntry ? strcmp(savedEntry, id) :
+	    cfg->defaultImage != FIRST_ENTRY_INDEX || !entry->fileText)
+		rc = cfi->setEnv(cfi, "saved_entry", id);
+
+	free(id);
+	return rc;
+}
+
+/* Write the BootLoaderSpec entries to the directory outName, or all of them
+ * to stdout, each after a comment naming its file. Only the files of new
+ * and changed entries are written and those of removed entries unlinked,
+ * so adding a kernel doesn't touch any of the others. */
+static int writeBlsConfig(struct grubConfig *cfg, const char *inName,
+			  const char *outName)
+{
+	struct singleEntry *entry;
+	int toStdout = !strcmp(outName, "-");
+	int sameDir = !toStdout && !strcmp(inName, outName);
+	char *text, *path;
+	FILE *out;
+
+	beginCommit();
+
+	if (writeKernelOpts(cfg))
+		goto err;
+
+	for (entry = cfg->entries; entry; entry = entry->next) {
+		if (entry->skip || entry->file)
+			continue;
+		blsNameEntry(cfg, entry);
+		if (!entry->file)
+			goto err;
+	}
+
+	for (entry = cfg->entries; entry; entry = entry->next) {
+		if (entry->skip && (!entry->file || !sameDir))
+			continue;
+
+		if (asprintf(&path, "%s/%s", outName, entry->file) < 0)
+			goto err;
+
+		if (entry->skip) {
+			int rc = stageRemoval(path);
+
+			free(path);
+			if (rc)
+				goto err;
+			continue;
+		}
+
+		text = renderEntry(entry, cfg->cfi);
+		if (!text) {
+			fprintf(stderr, _("grubby: error writing %s: %s\n"),
+				path, strerror(errno));
+			free(path);
+			goto err;
+		}
+
+		if (toStdout) {
+			printf("# %s\n%s", entry->file, text);
+		} else if (!sameDir || !entry->fileText ||
+			   strcmp(text, entry->fileText)) {
+			out = stageFile(path);
+			if (!out || fputs(text, out) == EOF) {
+				if (out)
+					fprintf(stderr,
+						_("grubby: error writing %s: "
+						  "%s\n"), path,
+						strerror(errno));
+				free(text);
+				free(path);
+				goto err;
+			}
+		}
+
+		free(text);
+		free(path);
+	}
+
+	if (blsWriteDefault(cfg))
+		goto err;
+
+	return finishCommit();
+
+err:
+	abortCommit();
+	return 1;
+}
+
+#define DIFF_CONTEXT 3
+
+struct diffOp {
+	char type;		/* ' ', '-' or '+' */
+	const char *text;
+	int len;
+};
+
+static void addDiffOp(struct diffOp **ops, int *numOps, int *alloced,
+		      char type, const char *text, int len)
+{
+	if (*numOps == *alloced) {
+		*alloced = *alloced ? *alloced * 2 : 64;
+		*ops = realloc(*ops, sizeof(**ops) * *alloced);
+	}
+	(*ops)[*numOps].type = type;
+	(*ops)[*numOps].text = text;
+	(*ops)[*numOps].len = len;
+	(*numOps)++;
+}
+
+static void writeHunkRange(FILE * out, char which, int start, int count)
+{
+	if (count == 1)
+		fprintf(out, "%c%d", which, start);
+	else
+		fprintf(out, "%c%d,%d", which, count ? start : start - 1,
+			count);
+}
+
+static void writeHunks(FILE * out, struct diffOp *ops, int numOps)
+{
+	int *oldNo = malloc(sizeof(*oldNo) * (numOps + 1));
+	int *newNo = malloc(sizeof(*newNo) * (numOps + 1));
+	int start, end, next;
+
+	oldNo[0] = newNo[0] = 1;
+	for (int i = 0; i < numOps; i++) {
+		oldNo[i + 1] = oldNo[i] + (ops[i].type != '+');
+		newNo[i + 1] = newNo[i] + (ops[i].type != '-');
+	}
+
+	for (int i = 0; i < numOps; i = end) {
+		while (i < numOps && ops[i].type == ' ')
+			i++;
+		if (i == numOps)
+			break;
+
+		start = i > DIFF_CONTEXT ? i - DIFF_CONTEXT : 0;
+
+		/* extend the hunk while the next change is close enough that
+		 * the two hunks' context would overlap */
+		end = i;
+		while (end < numOps) {
+			while (end < numOps && ops[end].type != ' ')
+				end++;
+			for (next = end;
+			     next < numOps && ops[next].type == ' '; next++) ;
+			if (next == numOps || next - end > 2 * DIFF_CONTEXT) {
+				end = end + DIFF_CONTEXT < numOps ?
+				    end + DIFF_CONTEXT : numOps;
+				break;
+			}
+			end = next;
+		}
+
+		fprintf(out, "@@ ");
+		writeHunkRange(out, '-', oldNo[start], oldNo[end] - oldNo[start]);
+		fprintf(out, " ");
+		writeHunkRange(out, '+', newNo[start], newNo[end] - newNo[start]);
+		fprintf(out, " @@\n");
+
+		for (int j = start; j < end; j++)
+			fprintf(out, "%c%.*s\n", ops[j].type, ops[j].len,
+				ops[j].text);
+	}
+
+	free(oldNo);
+	free(newNo);
+}
+
+/* $kernelopts is kept in the environment block rather than the config, so
+ * a change to it gets a hunk of its own against that file. */
+static int writeKernelOptsDiff(struct grubConfig *cfg)
+{
+	struct configFileInfo *cfi = cfg->cfi;
+	const char *envFile = cfi->envFile ? : "/boot/grub2/grubenv";
+	char *buf = NULL, *line, *next;
+	int fd, rc, lineno = 1;
+
+	if (!cfg->kernelOpts)
+		return 0;
+
+	fd = open(envFile, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, _("grubby: error opening %s: %m\n"), envFile);
+		return 1;
+	}
+	rc = readFile(fd, &buf);
+	close(fd);
+	if (rc)
+		return 1;
+
+	for (line = buf; line; line = next, lineno++) {
+		next = strchr(line, '\n');
+		if (next)
+			*next++ = '\0';
+		if (strncmp(line, KERNELOPTS "=", strlen(KERNELOPTS) + 1))
+			continue;
+
+		if (strcmp(line + strlen(KERNELOPTS) + 1, cfg->kernelOpts))
+			printf("--- %s\n+++ %s\n@@ -%d +%d @@\n-%s\n"
+			       "+" KERNELOPTS "=%s\n", envFile, envFile,
+			       lineno, lineno, line, cfg->kernelOpts);
+		break;
+	}
+
+	free(buf);
+	return 0;
+}
+
+/* Print what writeConfig() would change as a unified diff. Every line we
+ * write remembers which input line it came from, so only lines that were
+ * added, dropped (skipped entries) or rewritten need to be compared; no
+ * general purpose diff of the two files is done. */
+static int writeDiff(struct grubConfig *cfg, const char *inName,
+		     const char *outName)
+{
+	struct outputMap map = { NULL, 0, 0 };
+	struct diffOp *ops = NULL;
+	int numOps = 0, opsAlloced = 0;
+	char *text = NULL;
+	size_t size = 0;
+	int orig = 0;		/* next unconsumed original line */
+	int changed = 0;
+	int rc;
+	FILE *out;
+
+	out = open_memstream(&text, &size);
+	if (!out) {
+		fprintf(stderr, _("grubby: error creating diff: %m\n"));
+		return 1;
+	}
+
+	if (writeConfigLines(out, cfg, &map) == -1) {
+		fprintf(stderr, _("grubby: error creating diff: %m\n"));
+		fclose(out);
+		free(text);
+		free(map.origins);
+		return 1;
+	}
+	fclose(out);
+
+	for (int i = 0; i + 1 < map.numOrigins; i++) {
+		char *chunk = text + map.origins[i].offset;
+		char *chunkEnd = text + map.origins[i + 1].offset;
+		int lineno = map.origins[i].lineno;
 
-		if (rc == 0 && rename(tmpOutName, outName)) {
-			unlink(tmpOutName);
-			rc = 1;
+		if (chunk == chunkEnd) {
+			/* e.g. a fallback line which was dropped */
+			continue;
 		}
 
-		/* fsync() the destination directory after rename */
-		if (rc == 0) {
-			int dirfd;
+		if (lineno > orig && chunkEnd[-1] == '\n' &&
+		    memchr(chunk, '\n', chunkEnd - chunk) == chunkEnd - 1) {
+			const char *old = cfg->origLines[lineno - 1];
+			int len = chunkEnd - chunk - 1;
+
+			/* anything between here and the last line we used
+			 * didn't make it into the output */
+			for (; orig < lineno - 1; orig++) {
+				addDiffOp(&ops, &numOps, &opsAlloced, '-',
+					  cfg->origLines[orig],
+					  strlen(cfg->origLines[orig]));
+				changed = 1;
+			}
+			orig++;
 
-			dirfd = open(dirname(strdupa(outName)), O_RDONLY);
-			if (dirfd < 0)
-				rc = 1;
-			else if (fsync(dirfd))
-				rc = 1;
+			if (strlen(old) == len && !memcmp(old, chunk, len)) {
+				addDiffOp(&ops, &numOps, &opsAlloced, ' ',
+					  old, len);
+				continue;
+			}
 
-			if (dirfd >= 0)
-				close(dirfd);
+			addDiffOp(&ops, &numOps, &opsAlloced, '-', old,
+				  strlen(old));
+			changed = 1;
 		}
 
-		if (rc == 1)
-			fprintf(stderr,
-				_("grubby: error flushing data: %m\n"));
+		/* new or rewritten lines */
+		while (chunk < chunkEnd) {
+			char *nl = memchr(chunk, '\n', chunkEnd - chunk);
+
+			if (!nl)
+				nl = chunkEnd;
+			addDiffOp(&ops, &numOps, &opsAlloced, '+', chunk,
+				  nl - chunk);
+			changed = 1;
+			chunk = nl + 1;
+		}
 	}
 
-	if (out != stdout)
-		fclose(out);
+	for (; orig < cfg->numOrigLines; orig++) {
+		addDiffOp(&ops, &numOps, &opsAlloced, '-',
+			  cfg->origLines[orig], strlen(cfg->origLines[orig]));
+		changed = 1;
+	}
+
+	if (changed) {
+		printf("--- %s\n+++ %s\n", inName,
+		       strcmp(outName, "-") ? outName : inName);
+		writeHunks(stdout, ops, numOps);
+	}
+
+	rc = writeKernelOptsDiff(cfg);
+
+	free(ops);
+	free(text);
+	free(map.origins);
 	return rc;
 }
 
@@ -1978,79 +3964,84 @@ static int numEntries(struct grubConfig *cfg)
 	return i;
 }
 
-static char *findDiskForRoot()
+/* Find the device the root filesystem is on from the device number of /,
+ * which sysfs knows the name of. This doesn't work for filesystems like
+ * btrfs which don't report the number of a block device. */
+static char *findDiskForRootDev(void)
 {
-	int fd;
-	char buf[65536];
-	char *devname;
-	char *chptr;
-	int rc;
+	struct stat sb;
+	char path[64];
+	char *line = NULL;
+	size_t n = 0;
+	char *devname = NULL;
+	FILE *f;
 
-	if ((fd = open(_PATH_MOUNTED, O_RDONLY)) < 0) {
-		fprintf(stderr, "grubby: failed to open %s: %s\n",
-			_PATH_MOUNTED, strerror(errno));
+	if (stat("/", &sb) < 0 || !major(sb.st_dev))
 		return NULL;
-	}
 
-	rc = read(fd, buf, sizeof(buf) - 1);
-	if (rc <= 0) {
-		fprintf(stderr, "grubby: failed to read %s: %s\n",
-			_PATH_MOUNTED, strerror(errno));
-		close(fd);
+	snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/uevent",
+		 major(sb.st_dev), minor(sb.st_dev));
+	if (!(f = fopen(path, "r")))
 		return NULL;
-	}
-	close(fd);
-	buf[rc] = '\0';
-	chptr = buf;
 
-	char *foundanswer = NULL;
+	while (getline(&line, &n, f) > 0) {
+		if (!strncmp(line, "DEVNAME=", 8)) {
+			line[strcspn(line, "\n")] = '\0';
+			devname = sdupprintf("/dev/%s", line + 8);
+			break;
+		}
+	}
+	free(line);
+	fclose(f);
 
-	while (chptr && chptr != buf + rc) {
-		devname = chptr;
+	if (devname && (stat(devname, &sb) < 0 || !S_ISBLK(sb.st_mode))) {
+		free(devname);
+		devname = NULL;
+	}
 
-		/*
-		 * The first column of a mtab entry is the device, but if the
-		 * entry is a special device it won't start with /, so move
-		 * on to the next line.
-		 */
-		if (*devname != '/') {
-			chptr = strchr(chptr, '\n');
-			if (chptr)
-				chptr++;
-			continue;
-		}
+	return devname;
+}
 
-		/* Seek to the next space */
-		chptr = strchr(chptr, ' ');
-		if (!chptr) {
-			fprintf(stderr, "grubby: error parsing %s: %s\n",
-				_PATH_MOUNTED, strerror(errno));
-			return NULL;
-		}
+/* Otherwise it's the device of the last / entry in mtab. */
+static char *findDiskForRootMount(void)
+{
+	struct mntent *ent;
+	char *devname = NULL;
+	FILE *f;
 
-		/*
-		 * The second column of a mtab entry is the mount point, we
-		 * are looking for '/' obviously.
-		 */
-		if (*(++chptr) == '/' && *(++chptr) == ' ') {
-			/* remember the last / entry in mtab */
-			foundanswer = devname;
-		}
+	if (!(f = setmntent(_PATH_MOUNTED, "r"))) {
+		fprintf(stderr, "grubby: failed to open %s: %s\n",
+			_PATH_MOUNTED, strerror(errno));
+		return NULL;
+	}
 
-		/* Next line */
-		chptr = strchr(chptr, '\n');
-		if (chptr)
-			chptr++;
+	while ((ent = getmntent(f))) {
+		/* special devices don't start with / */
+		if (*ent->mnt_fsname != '/' || strcmp(ent->mnt_dir, "/"))
+			continue;
+		free(devname);
+		devname = strdup(ent->mnt_fsname);
 	}
+	endmntent(f);
 
-	/* Return the last / entry found */
-	if (foundanswer) {
-		chptr = strchr(foundanswer, ' ');
-		*chptr = '\0';
-		return strdup(foundanswer);
+	return devname;
+}
+
+/* The answer doesn't change while we run, so it's only looked up once;
+ * the caller gets its own copy. */
+static char *findDiskForRoot()
+{
+	static char *rootDisk;
+	static int looked;
+
+	if (!looked) {
+		rootDisk = findDiskForRootDev();
+		if (!rootDisk)
+			rootDisk = findDiskForRootMount();
+		looked = 1;
 	}
 
-	return NULL;
+	return rootDisk ? strdup(rootDisk) : NULL;
 }
 
 void printEntry(struct singleEntry *entry, FILE * f)
@@ -2276,8 +4267,8 @@ int suitableImage(struct singleEntry *entry, const char *bootPrefix,
 	}
 
 	line =
-	    getLineByType(LT_KERNEL | LT_HYPER | LT_KERNEL_EFI | LT_KERNEL_16,
-			  entry->lines);
+	    getEntryLineByType(LT_KERNEL | LT_HYPER | LT_KERNEL_EFI | LT_KERNEL_16,
+			  entry);
 	if (!line) {
 		notSuitablePrintf(entry, 0, "no line found\n");
 		return 0;
@@ -2311,7 +4302,7 @@ int suitableImage(struct singleEntry *entry, const char *bootPrefix,
 		dev = line->elements[i].item + 5;
 	} else {
 		/* look for a lilo style LT_ROOT line */
-		line = getLineByType(LT_ROOT, entry->lines);
+		line = getEntryLineByType(LT_ROOT, entry);
 
 		if (line && line->numElements >= 2) {
 			dev = line->elements[1].item;
@@ -2321,8 +4312,8 @@ int suitableImage(struct singleEntry *entry, const char *bootPrefix,
 			 * for the args, so check that too.
 			 */
 			line =
-			    getLineByType(LT_KERNELARGS | LT_MBMODULE,
-					  entry->lines);
+			    getEntryLineByType(LT_KERNELARGS | LT_MBMODULE,
+					  entry);
 
 			/* failed to find one */
 			if (!line) {
@@ -2381,6 +4372,358 @@ int suitableImage(struct singleEntry *entry, const char *bootPrefix,
 	return 1;
 }
 
+/* A selector picks entries by what's in them, for MATCH=expression. The
+ * expression is made of terms joined with "&&", "||", "!" and parentheses:
+ *
+ *   kernel=glob  kernel~regex   the kernel, as --info shows it
+ *   title=glob   title~regex    the title
+ *   initrd=glob  initrd~regex   the (first) initrd
+ *   arg=name                    an argument name or name=anything
+ *   arg=name=glob               an argument with a matching value
+ *   index=n  index=n-m  index=n-  the entry's index
+ *
+ * Values may be quoted with ' or ". */
+enum selectorType {
+	SEL_AND,
+	SEL_OR,
+	SEL_NOT,
+	SEL_KERNEL,
+	SEL_TITLE,
+	SEL_INITRD,
+	SEL_ARG,
+	SEL_INDEX,
+};
+
+struct selector {
+	enum selectorType type;
+	struct selector *left, *right;
+	char *pattern;
+	int isRegex;
+	regex_t regex;
+	int first, last;	/* SEL_INDEX */
+};
+
+struct selectorMatch {
+	struct grubConfig *cfg;
+	struct singleEntry *entry;
+	const char *prefix;
+	int index;
+};
+
+static struct selector *parseSelectorOr(const char **s);
+
+static void skipSpace(const char **s)
+{
+	while (isspace(**s))
+		(*s)++;
+}
+
+static void selectorFree(struct selector *sel)
+{
+	if (!sel)
+		return;
+	selectorFree(sel->left);
+	selectorFree(sel->right);
+	if (sel->isRegex)
+		regfree(&sel->regex);
+	free(sel->pattern);
+	free(sel);
+}
+
+/* a value runs to the next space, ')', "&&" or "||" unless it's quoted */
+static char *parseSelectorValue(const char **s)
+{
+	const char *start = *s;
+
+	if (isquote(**s)) {
+		char quote = *(*s)++;
+
+		start = *s;
+		while (**s && **s != quote)
+			(*s)++;
+		if (!**s)
+			return NULL;
+		return strndup(start, (*s)++ - start);
+	}
+
+	while (**s && !isspace(**s) && **s != ')' &&
+	       strncmp(*s, "&&", 2) && strncmp(*s, "||", 2))
+		(*s)++;
+	if (*s == start)
+		return NULL;
+	return strndup(start, *s - start);
+}
+
+static struct selector *parseSelectorTerm(const char **s)
+{
+	static const struct {
+		const char *key;
+		enum selectorType type;
+	} keys[] = {
+		{"kernel", SEL_KERNEL},
+		{"title", SEL_TITLE},
+		{"initrd", SEL_INITRD},
+		{"arg", SEL_ARG},
+		{"index", SEL_INDEX},
+	};
+	struct selector *sel;
+	char *end;
+	unsigned int i;
+	size_t len;
+
+	skipSpace(s);
+	if (**s == '!') {
+		(*s)++;
+		sel = calloc(1, sizeof(*sel));
+		sel->type = SEL_NOT;
+		if (!(sel->left = parseSelectorTerm(s))) {
+			selectorFree(sel);
+			return NULL;
+		}
+		return sel;
+	} else if (**s == '(') {
+		(*s)++;
+		sel = parseSelectorOr(s);
+		skipSpace(s);
+		if (!sel || **s != ')') {
+			selectorFree(sel);
+			return NULL;
+		}
+		(*s)++;
+		return sel;
+	}
+
+	for (i = 0; i < sizeof(keys) / sizeof(keys[0]); i++) {
+		len = strlen(keys[i].key);
+		if (!strncmp(*s, keys[i].key, len) &&
+		    ((*s)[len] == '=' || (*s)[len] == '~'))
+			break;
+	}
+	if (i == sizeof(keys) / sizeof(keys[0]))
+		return NULL;
+
+	sel = calloc(1, sizeof(*sel));
+	sel->type = keys[i].type;
+	sel->isRegex = (*s)[len] == '~';
+	*s += len + 1;
+	if (!(sel->pattern = parseSelectorValue(s))) {
+		free(sel);
+		return NULL;
+	}
+
+	if (sel->type == SEL_INDEX) {
+		sel->first = strtol(sel->pattern, &end, 10);
+		sel->last = sel->first;
+		if (*end == '-' && !end[1]) {
+			sel->last = INT_MAX;
+			end++;
+		} else if (*end == '-') {
+			sel->last = strtol(end + 1, &end, 10);
+		}
+		if (sel->isRegex || end == sel->pattern || *end ||
+		    !isdigit(*sel->pattern)) {
+			sel->isRegex = 0;
+			selectorFree(sel);
+			return NULL;
+		}
+	} else if (sel->isRegex && (sel->type == SEL_ARG ||
+				    regcomp(&sel->regex, sel->pattern,
+					    REG_EXTENDED | REG_NOSUB))) {
+		sel->isRegex = 0;
+		selectorFree(sel);
+		return NULL;
+	}
+
+	return sel;
+}
+
+static struct selector *parseSelectorAnd(const char **s)
+{
+	struct selector *sel, *and;
+
+	sel = parseSelectorTerm(s);
+	skipSpace(s);
+	while (sel && !strncmp(*s, "&&", 2)) {
+		*s += 2;
+		and = calloc(1, sizeof(*and));
+		and->type = SEL_AND;
+		and->left = sel;
+		and->right = parseSelectorTerm(s);
+		sel = and;
+		if (!sel->right) {
+			selectorFree(sel);
+			return NULL;
+		}
+		skipSpace(s);
+	}
+	return sel;
+}
+
+static struct selector *parseSelectorOr(const char **s)
+{
+	struct selector *sel, *or;
+
+	sel = parseSelectorAnd(s);
+	while (sel && !strncmp(*s, "||", 2)) {
+		*s += 2;
+		or = calloc(1, sizeof(*or));
+		or->type = SEL_OR;
+		or->left = sel;
+		or->right = parseSelectorAnd(s);
+		sel = or;
+		if (!sel->right) {
+			selectorFree(sel);
+			return NULL;
+		}
+	}
+	return sel;
+}
+
+/* The selector for the expression, compiled the first time it's asked for.
+ * The lookups for the rest of the matches get the same one back. */
+static struct selector *getSelector(const char *expr)
+{
+	static struct selector *sel;
+	static char *selExpr;
+	const char *s = expr;
+
+	if (selExpr && !strcmp(selExpr, expr))
+		return sel;
+
+	selectorFree(sel);
+	free(selExpr);
+	selExpr = strdup(expr);
+	sel = parseSelectorOr(&s);
+	skipSpace(&s);
+	if (sel && *s) {
+		selectorFree(sel);
+		sel = NULL;
+	}
+	if (!sel)
+		fprintf(stderr, _("grubby: bad selector \"%s\"\n"), expr);
+	return sel;
+}
+
+/* is path a MATCH= expression which doesn't parse */
+static int badSelector(const char *path)
+{
+	return path && !strncmp(path, "MATCH=", 6) && !getSelector(path + 6);
+}
+
+static int selectorMatchString(struct selector *sel, const char *s)
+{
+	if (!s)
+		return 0;
+	if (sel->isRegex)
+		return !regexec(&sel->regex, s, 0, NULL, 0);
+	return !fnmatch(sel->pattern, s, 0);
+}
+
+/* a path as --info shows it, with the boot prefix */
+static int selectorMatchPath(struct selector *sel, const char *prefix,
+			     const char *path)
+{
+	char *full;
+
+	if (!strncmp(prefix, path, strlen(prefix)))
+		return selectorMatchString(sel, path);
+
+	full = alloca(strlen(prefix) + strlen(path) + 1);
+	stpcpy(stpcpy(full, prefix), path);
+	return selectorMatchString(sel, full);
+}
+
+static int selectorMatchArg(struct selector *sel, const char *arg)
+{
+	size_t len = strcspn(arg, "=");
+
+	/* without a value in the pattern, any value will do */
+	if (!strchr(sel->pattern, '='))
+		return !fnmatch(sel->pattern, strndupa(arg, len), 0);
+	return !fnmatch(sel->pattern, arg, 0);
+}
+
+static int selectorMatchArgs(struct selectorMatch *m, struct selector *sel)
+{
+	struct singleLine *line;
+	char *opts, *arg;
+	int i;
+
+	line = getEntryLineByType(LT_KERNEL | LT_HYPER | LT_KERNEL_EFI |
+				  LT_KERNEL_16, m->entry);
+	if (line && line->numElements >= 3) {
+		i = 2;
+	} else {
+		line = getEntryLineByType(LT_KERNELARGS, m->entry);
+		i = 1;
+	}
+	if (!line)
+		return 0;
+
+	for (; i < line->numElements; i++) {
+		if (!isKernelOptsRef(line->elements[i].item)) {
+			if (selectorMatchArg(sel, line->elements[i].item))
+				return 1;
+			continue;
+		}
+
+		/* look at what the variable holds instead */
+		if (!(opts = (char *)getKernelOpts(m->cfg)))
+			continue;
+		opts = strdupa(opts);
+		while ((arg = strsep(&opts, " \t")))
+			if (*arg && selectorMatchArg(sel, arg))
+				return 1;
+	}
+	return 0;
+}
+
+static int selectorMatches(struct selectorMatch *m, struct selector *sel)
+{
+	struct singleLine *line;
+	char *title;
+	int rc;
+
+	switch (sel->type) {
+	case SEL_AND:
+		return selectorMatches(m, sel->left) &&
+		    selectorMatches(m, sel->right);
+	case SEL_OR:
+		return selectorMatches(m, sel->left) ||
+		    selectorMatches(m, sel->right);
+	case SEL_NOT:
+		return !selectorMatches(m, sel->left);
+	case SEL_INDEX:
+		return m->index >= sel->first && m->index <= sel->last;
+	case SEL_ARG:
+		return selectorMatchArgs(m, sel);
+	case SEL_KERNEL:
+		line = getEntryLineByType(LT_KERNEL | LT_HYPER | LT_KERNEL_EFI |
+					  LT_KERNEL_16, m->entry);
+		return line && line->numElements >= 2 &&
+		    selectorMatchPath(sel, m->prefix, line->elements[1].item);
+	case SEL_INITRD:
+		line = getEntryLineByType(LT_INITRD | LT_INITRD_EFI |
+					  LT_INITRD_16, m->entry);
+		return line && line->numElements >= 2 &&
+		    selectorMatchPath(sel, m->prefix, line->elements[1].item);
+	case SEL_TITLE:
+		line = getEntryLineByType(LT_TITLE, m->entry);
+		if (line)
+			title = extractTitle(m->cfg, line);
+		else if ((line = getEntryLineByType(LT_MENUENTRY, m->entry)))
+			title = grub2ExtractTitle(line);
+		else
+			return 0;
+		if (!title && line->numElements >= 2)
+			title = strdup(line->elements[1].item);
+		rc = selectorMatchString(sel, title);
+		free(title);
+		return rc;
+	}
+	return 0;
+}
+
 /* returns the first match on or after the one pointed to by index (if index 
    is not NULL) which is not marked as skip */
 struct singleEntry *findEntryByPath(struct grubConfig *config,
@@ -2394,14 +4737,33 @@ struct singleEntry *findEntryByPath(struct grubConfig *config,
 	enum lineType_e checkType = LT_KERNEL;
 
 	if (isdigit(*kernel)) {
-		int *indexVars = alloca(sizeof(*indexVars) * strlen(kernel));
+		int *indexVars =
+		    alloca(sizeof(*indexVars) * (strlen(kernel) + 1));
 
 		i = 0;
-		indexVars[i] = strtol(kernel, &chptr, 10);
-		while (*chptr == ',') {
+		while (1) {
+			indexVars[i] = strtol(kernel, &chptr, 10);
+			/* "1>0" counts through the menu like grub does */
+			if (*chptr == '>') {
+				size_t len = 0;
+				char *path;
+
+				/* titles have commas too, only one which
+				 * comes before another index ends the path */
+				while (kernel[len] && (kernel[len] != ',' ||
+						       !isdigit(kernel[len + 1])))
+					len++;
+				path = strndupa(kernel, len);
+
+				if (!findEntryByMenuPath(config, path,
+							 &indexVars[i]))
+					return NULL;
+				chptr = (char *)kernel + strlen(path);
+			}
+			if (*chptr != ',')
+				break;
 			i++;
 			kernel = chptr + 1;
-			indexVars[i] = strtol(kernel, &chptr, 10);
 		}
 
 		if (*chptr) {
@@ -2425,8 +4787,8 @@ struct singleEntry *findEntryByPath(struct grubConfig *config,
 			return NULL;
 
 		line =
-		    getLineByType(LT_KERNEL | LT_HYPER | LT_KERNEL_EFI |
-				  LT_KERNEL_16, entry->lines);
+		    getEntryLineByType(LT_KERNEL | LT_HYPER | LT_KERNEL_EFI |
+				  LT_KERNEL_16, entry);
 		if (!line)
 			return NULL;
 
@@ -2459,6 +4821,39 @@ struct singleEntry *findEntryByPath(struct grubConfig *config,
 
 		if (entry && index)
 			*index = i;
+	} else if (!strncmp(kernel, "MATCH=", 6)) {
+		struct selector *sel = getSelector(kernel + 6);
+		struct selectorMatch m = {.cfg = config,.prefix = prefix };
+
+		/* one pass over the entries, starting where the last match
+		 * left off */
+		i = index ? *index : 0;
+		for (entry = sel ? findEntryByIndex(config, i) : NULL; entry;
+		     entry = entry->next, i++) {
+			if (entry->skip)
+				continue;
+			parseEntry(config, entry);
+			if (!getEntryLineByType(LT_KERNEL | LT_HYPER |
+						LT_KERNEL_EFI | LT_KERNEL_16,
+						entry))
+				continue;
+			m.entry = entry;
+			m.index = i;
+			if (selectorMatches(&m, sel))
+				break;
+		}
+
+		if (entry && index)
+			*index = i;
+	} else if (!strncmp(kernel, "ID=", 3)) {
+		entry = findEntryById(config, kernel + 3, &i);
+		if (entry && (entry->skip || (index && i < *index) ||
+			      !getEntryLineByType(LT_KERNEL | LT_HYPER |
+						  LT_KERNEL_EFI | LT_KERNEL_16,
+						  entry)))
+			entry = NULL;
+		if (entry && index)
+			*index = i;
 	} else {
 		if (index)
 			i = *index;
@@ -2469,6 +4864,22 @@ struct singleEntry *findEntryByPath(struct grubConfig *config,
 			prefix = "";
 			checkType = LT_TITLE | LT_MENUENTRY;
 			kernel += 6;
+
+			if (strchr(kernel, '>')) {
+				entry = findEntryByMenuPath(config, kernel, &i);
+				if (entry && (!index || i >= *index) &&
+				    getEntryLineByType(LT_KERNEL | LT_HYPER |
+						       LT_KERNEL_EFI |
+						       LT_KERNEL_16, entry)) {
+					if (index)
+						*index = i;
+					return entry;
+				}
+				if (index)
+					i = *index;
+				else
+					i = 0;
+			}
 		}
 
 		for (entry = findEntryByIndex(config, i); entry;
@@ -2478,6 +4889,7 @@ struct singleEntry *findEntryByPath(struct grubConfig *config,
 
 			dbgPrintf("findEntryByPath looking for %d %s in %p\n",
 				  checkType, kernel, entry);
+			parseEntry(config, entry);
 
 			/* check all the lines matching checkType */
 			for (line = entry->lines; line; line = line->next) {
@@ -2511,9 +4923,9 @@ struct singleEntry *findEntryByPath(struct grubConfig *config,
 			 * unfortunate)
 			 */
 			if (line
-			    && getLineByType(LT_KERNEL | LT_HYPER |
+			    && getEntryLineByType(LT_KERNEL | LT_HYPER |
 					     LT_KERNEL_EFI | LT_KERNEL_16,
-					     entry->lines))
+					     entry))
 				break;	/* found 'im! */
 		}
 
@@ -2524,38 +4936,130 @@ struct singleEntry *findEntryByPath(struct grubConfig *config,
 	return entry;
 }
 
-struct singleEntry *findEntryByTitle(struct grubConfig *cfg, char *title,
-				     int *index)
+struct singleEntry *findEntryByTitle(struct grubConfig *cfg, char *title,
+				     int *index)
+{
+	struct singleEntry *entry;
+	struct singleLine *line;
+	int i;
+	char *newtitle;
+
+	/* "submenu>entry", as grub writes saved_entry for nested entries */
+	if (strchr(title, '>')) {
+		i = 0;
+		entry = findEntryByMenuPath(cfg, title, &i);
+		if (entry && (!index || i >= *index)) {
+			if (index)
+				*index = i;
+			return entry;
+		}
+	}
+
+	for (i = 0, entry = cfg->entries; entry; entry = entry->next, i++) {
+		if (index && i < *index)
+			continue;
+		parseEntry(cfg, entry);
+		line = getEntryLineByType(LT_TITLE, entry);
+		if (!line)
+			line = getEntryLineByType(LT_MENUENTRY, entry);
+		if (!line)
+			continue;
+		newtitle = grub2ExtractTitle(line);
+		if (!newtitle)
+			continue;
+		if (!strcmp(title, newtitle)) {
+			free(newtitle);
+			break;
+		}
+		free(newtitle);
+	}
+
+	if (!entry)
+		return NULL;
+
+	if (index)
+		*index = i;
+	return entry;
+}
+
+/* Look up a grub2 menu path such as "1>0" or "Advanced options>Fedora": each
+ * '>' separated component picks an item of the submenu before it (or of the
+ * top level menu) by its position or title, which is how grub resolves
+ * saved_entry. Positions only count menuentry and submenu blocks, so unlike
+ * the entry indexes they match what grub shows. *index is set to the entry's
+ * index. */
+struct singleEntry *findEntryByMenuPath(struct grubConfig *cfg,
+					const char *path, int *index)
+{
+	struct singleEntry **items = cfg->menu;
+	int numItems = cfg->numMenu;
+	struct singleEntry *entry = NULL, *parent = NULL, *e;
+	struct singleLine *line;
+	char *copy, *component, *title;
+	int i;
+
+	copy = strdupa(path);
+	while ((component = strsep(&copy, ">"))) {
+		if (entry && !getEntryLineByType(LT_SUBMENU, entry))
+			return NULL;
+		parent = entry;
+		entry = NULL;
+
+		if (isnumber(component)) {
+			i = atoi(component);
+			if (i < numItems)
+				entry = items[i];
+		} else if ((e = findEntryById(cfg, component, NULL)) &&
+			   e->parent == parent) {
+			entry = e;
+		} else {
+			for (i = 0; i < numItems && !entry; i++) {
+				line = getEntryLineByType(LT_MENUENTRY |
+							  LT_SUBMENU, items[i]);
+				title = line ? grub2ExtractTitle(line) : NULL;
+				if (title && !strcmp(title, component))
+					entry = items[i];
+				free(title);
+			}
+		}
+		if (!entry || entry->skip)
+			return NULL;
+
+		items = entry->children;
+		numItems = entry->numChildren;
+	}
+
+	if (index) {
+		for (i = 0, e = cfg->entries; e && e != entry; e = e->next)
+			i++;
+		*index = i;
+	}
+	return entry;
+}
+
+/* Find the entry grub2's saved_entry refers to, by its id, title or index.
+ * grub counts its numbers through the menu, not the way grubby's indexes
+ * do. */
+static struct singleEntry *findEntryBySavedEntry(struct grubConfig *cfg,
+						 char *value, int *index)
 {
 	struct singleEntry *entry;
-	struct singleLine *line;
 	int i;
-	char *newtitle;
 
-	for (i = 0, entry = cfg->entries; entry; entry = entry->next, i++) {
-		if (index && i < *index)
-			continue;
-		line = getLineByType(LT_TITLE, entry->lines);
-		if (!line)
-			line = getLineByType(LT_MENUENTRY, entry->lines);
-		if (!line)
-			continue;
-		newtitle = grub2ExtractTitle(line);
-		if (!newtitle)
-			continue;
-		if (!strcmp(title, newtitle)) {
-			free(newtitle);
-			break;
-		}
-		free(newtitle);
+	if (isnumber(value) && !cfg->numMenu) {
+		*index = atoi(value);
+		return findEntryByIndex(cfg, *index);
+	} else if (isnumber(value)) {
+		return findEntryByMenuPath(cfg, value, index);
 	}
 
-	if (!entry)
-		return NULL;
-
-	if (index)
+	/* grub only looks at the top level menu for a plain id */
+	entry = findEntryById(cfg, value, &i);
+	if (entry && !entry->parent) {
 		*index = i;
-	return entry;
+		return entry;
+	}
+	return findEntryByTitle(cfg, value, index);
 }
 
 struct singleEntry *findEntryByIndex(struct grubConfig *cfg, int index)
@@ -2568,6 +5072,7 @@ struct singleEntry *findEntryByIndex(struct grubConfig *cfg, int index)
 		index--;
 	}
 
+	parseEntry(cfg, entry);
 	return entry;
 }
 
@@ -2588,14 +5093,8 @@ struct singleEntry *findTemplate(struct grubConfig *cfg, const char *prefix,
 			    cfg->cfi->getEnv(cfg->cfi, "saved_entry");
 			if (defTitle) {
 				int index = 0;
-				if (isnumber(defTitle)) {
-					index = atoi(defTitle);
-					entry = findEntryByIndex(cfg, index);
-				} else {
-					entry =
-					    findEntryByTitle(cfg, defTitle,
-							     &index);
-				}
+				entry = findEntryBySavedEntry(cfg, defTitle,
+							      &index);
 				if (entry
 				    && suitableImage(entry, prefix, skipRemoved,
 						     flags)) {
@@ -2679,10 +5178,154 @@ void markRemovedImage(struct grubConfig *cfg, const char *image,
 		return;
 	}
 
-	while ((entry = findEntryByPath(cfg, image, prefix, NULL)))
+	for (int i = 0; (entry = findEntryByPath(cfg, image, prefix, &i)); i++)
 		entry->skip = 1;
 }
 
+/* the names in a directory, which --remove-stale reads once */
+struct bootDir {
+	char *path;
+	char **names;		/* sorted */
+	int numNames;
+	int unknown;		/* it couldn't be read, so anything goes */
+	struct bootDir *next;
+};
+
+static int nameCompare(const void *a, const void *b)
+{
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static struct bootDir *readBootDir(struct bootDir **dirs, const char *path)
+{
+	struct bootDir *d;
+	struct dirent *ent;
+	struct stat sb;
+	DIR *dir;
+	int alloced = 0;
+
+	for (d = *dirs; d; d = d->next)
+		if (!strcmp(d->path, path))
+			return d;
+
+	d = calloc(1, sizeof(*d));
+	d->path = strdup(path);
+	d->next = *dirs;
+	*dirs = d;
+
+	dir = opendir(path);
+	if (!dir) {
+		/* a missing directory has nothing in it */
+		d->unknown = errno != ENOENT && errno != ENOTDIR;
+		return d;
+	}
+
+	while ((ent = readdir(dir))) {
+		if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, ".."))
+			continue;
+		/* dangling links don't count */
+		if (ent->d_type == DT_LNK &&
+		    fstatat(dirfd(dir), ent->d_name, &sb, 0))
+			continue;
+		if (d->numNames == alloced) {
+			alloced = alloced ? alloced * 2 : 64;
+			d->names = realloc(d->names,
+					   sizeof(*d->names) * alloced);
+		}
+		d->names[d->numNames++] = strdup(ent->d_name);
+	}
+	closedir(dir);
+
+	qsort(d->names, d->numNames, sizeof(*d->names), nameCompare);
+	return d;
+}
+
+/* is the file there, by the listing of its directory */
+static int bootFileExists(struct bootDir **dirs, const char *prefix,
+			  const char *item)
+{
+	size_t rs = getRootSpecifier(item);
+	char *fullName, *base;
+	const char *dirName;
+	struct bootDir *d;
+
+	/* there's no telling where a variable points */
+	if (strchr(item, '$'))
+		return 1;
+
+	fullName = alloca(strlen(prefix) + strlen(item) + 2);
+	sprintf(fullName, "%s%s%s", prefix,
+		endswith(prefix, '/') || beginswith(item + rs, '/') ? "" : "/",
+		item + rs);
+
+	base = strrchr(fullName, '/');
+	if (!base) {
+		dirName = ".";
+		base = fullName;
+	} else {
+		dirName = base == fullName ? "/" : strndupa(fullName,
+							    base - fullName);
+		base++;
+	}
+
+	d = readBootDir(dirs, dirName);
+	return d->unknown || bsearch(&base, d->names, d->numNames,
+				     sizeof(*d->names), nameCompare);
+}
+
+/* Mark the entries whose kernel, initrds, device tree or multiboot modules
+ * are gone as removed, reading each directory they're in just once.
+ * Returns how many kernel entries are left. */
+int markStaleImages(struct grubConfig *cfg, const char *prefix)
+{
+	struct bootDir *dirs = NULL, *d;
+	struct singleEntry *entry;
+	struct singleLine *line;
+	int i, last, left = 0;
+
+	for (entry = cfg->entries; entry; entry = entry->next) {
+		if (entry->skip)
+			continue;
+		parseEntry(cfg, entry);
+		if (!getEntryLineByType(LT_KERNEL | LT_HYPER | LT_KERNEL_EFI |
+					LT_KERNEL_16, entry))
+			continue;
+
+		for (line = entry->lines; line && !entry->skip;
+		     line = line->next) {
+			if (!(line->type & (LT_KERNEL | LT_HYPER |
+					    LT_KERNEL_EFI | LT_KERNEL_16 |
+					    LT_MBMODULE | LT_DEVTREE)) &&
+			    !isinitrd(line->type))
+				continue;
+
+			/* an initrd line may have more than one */
+			last = isinitrd(line->type) ? line->numElements - 1 : 1;
+			for (i = 1; i <= last && i < line->numElements; i++) {
+				if (bootFileExists(&dirs, prefix,
+						   line->elements[i].item))
+					continue;
+				dbgPrintf("%s is missing, removing the entry\n",
+					  line->elements[i].item);
+				entry->skip = 1;
+				break;
+			}
+		}
+		if (!entry->skip)
+			left++;
+	}
+
+	while ((d = dirs)) {
+		dirs = d->next;
+		for (i = 0; i < d->numNames; i++)
+			free(d->names[i]);
+		free(d->names);
+		free(d->path);
+		free(d);
+	}
+	return left;
+}
+
 void setDefaultImage(struct grubConfig *config, int isAddingBootEntry,
 		     const char *defaultKernelPath, int newBootEntryIsDefault,
 		     const char *prefix, int flags,
@@ -2767,11 +5410,7 @@ void setDefaultImage(struct grubConfig *config, int isAddingBootEntry,
                                 char *defaultTitle = config->cfi->getEnv(config->cfi, "saved_entry");
 
                                 if (defaultTitle) {
-                                    if (isnumber(defaultTitle)) {
-                                        currentLookupIndex = atoi(defaultTitle);
-                                    } else {
-                                        findEntryByTitle(config, defaultTitle, &currentLookupIndex);
-                                    }
+                                    findEntryBySavedEntry(config, defaultTitle, &currentLookupIndex);
                                     /* set the default Image to an actual index */
                                     config->defaultImage = currentLookupIndex;
                                 }
@@ -2852,6 +5491,256 @@ void setFallbackImage(struct grubConfig *config, int hasNew)
 	}
 }
 
+/* sort key for --sort-entries, computed once per entry */
+struct entrySortKey {
+	struct singleEntry *entry;
+	struct nvr nvr;
+	int hasKernel;
+	int pos;		/* original position, to keep the sort stable */
+	char *flavor;		/* for --retain, see kernelFlavor() */
+};
+
+static int entrySortKeyCompare(const void *a, const void *b)
+{
+	const struct entrySortKey *ka = a, *kb = b;
+	int rc;
+
+	/* entries without a kernel go after all the kernels */
+	if (ka->hasKernel != kb->hasKernel)
+		return kb->hasKernel - ka->hasKernel;
+
+	/* newest kernel first */
+	if (ka->hasKernel) {
+		rc = nvr_compare(&kb->nvr, &ka->nvr, nvr_rpmvercmp);
+		if (rc)
+			return rc;
+	}
+
+	return ka->pos - kb->pos;
+}
+
+/* the entry at index among the entries which will be written out */
+static struct singleEntry *outputIndexEntry(struct grubConfig *cfg, int index)
+{
+	struct singleEntry *entry;
+	int i = 0;
+
+	for (entry = cfg->entries; entry; entry = entry->next) {
+		if (entry->skip)
+			continue;
+		if (i++ == index)
+			break;
+	}
+	return entry;
+}
+
+/* index of entry among the entries which will be written out */
+static int entryOutputIndex(struct grubConfig *cfg, struct singleEntry *entry)
+{
+	struct singleEntry *e;
+	int i = 0;
+
+	for (e = cfg->entries; e && e != entry; e = e->next)
+		if (!e->skip)
+			i++;
+
+	return e ? i : -1;
+}
+
+/* Reorder the entries by the version of their kernel, newest first. The
+ * kernel's file name (vmlinuz-<version>-<release>) is compared the same
+ * way rpm-sort does it. The default and fallback entries stay the same. */
+static int sortEntries(struct grubConfig *cfg)
+{
+	struct singleEntry *entry, *defEntry = NULL, *fallbackEntry = NULL;
+	struct entrySortKey *keys;
+	struct singleLine *line;
+	const char *name;
+	int n = 0, i;
+	int *newIndex;
+
+	for (entry = cfg->entries; entry; entry = entry->next) {
+		/* moving entries in and out of submenus would break them */
+		if (entry->parent || entry->children) {
+			fprintf(stderr, _("grubby: can't sort entries which "
+					  "are in a submenu\n"));
+			return 1;
+		}
+		n++;
+	}
+	if (n < 2)
+		return 0;
+
+	if (cfg->defaultImage >= FIRST_ENTRY_INDEX)
+		defEntry = outputIndexEntry(cfg, cfg->defaultImage);
+	if (cfg->fallbackImage >= 0)
+		fallbackEntry = outputIndexEntry(cfg, cfg->fallbackImage);
+
+	keys = calloc(n, sizeof(*keys));
+	if (!keys)
+		return 1;
+
+	for (entry = cfg->entries, i = 0; entry; entry = entry->next, i++) {
+		keys[i].entry = entry;
+		keys[i].pos = i;
+
+		line = getEntryLineByType(LT_KERNEL | LT_KERNEL_EFI | LT_KERNEL_16,
+				     entry);
+		if (!line || line->numElements < 2)
+			continue;
+
+		name = strrchr(line->elements[1].item, '/');
+		name = name ? name + 1 : line->elements[1].item;
+		if (nvr_init(&keys[i].nvr, name))
+			continue;
+		keys[i].hasKernel = 1;
+	}
+
+	qsort(keys, n, sizeof(*keys), entrySortKeyCompare);
+
+	newIndex = malloc(sizeof(*newIndex) * n);
+	cfg->entries = keys[0].entry;
+	for (i = 0; i < n; i++) {
+		keys[i].entry->next = i + 1 < n ? keys[i + 1].entry : NULL;
+		newIndex[keys[i].pos] = i;
+		if (keys[i].hasKernel)
+			nvr_fini(&keys[i].nvr);
+	}
+	free(keys);
+	entryIdsMoved(cfg, newIndex);
+	free(newIndex);
+
+	if (defEntry)
+		cfg->defaultImage = entryOutputIndex(cfg, defEntry);
+	if (fallbackEntry)
+		cfg->fallbackImage = entryOutputIndex(cfg, fallbackEntry);
+
+	return 0;
+}
+
+/* The flavor of a kernel from its file name: the name before the version,
+ * and the variant after it, if any. That's what follows a '+' (Fedora's
+ * "+debug"), a ".debug" at the end (older RHEL) or a last '-' part which is
+ * a word (SUSE's "-default"). Rescue kernels are a flavor of their own. */
+static char *kernelFlavor(const char *name)
+{
+	const char *version = name, *variant = "";
+	char *flavor;
+	size_t len;
+
+	/* the version starts at the first "-<digit>" */
+	while ((version = strchr(version, '-')) && !isdigit(version[1]))
+		version++;
+	if (!version)
+		return strdup(name);
+
+	if (!strncmp(version, "-0-rescue-", 10)) {
+		variant = "-rescue";
+	} else if (strchr(version, '+')) {
+		variant = strchr(version, '+');
+	} else if ((len = strlen(version)) > 6 &&
+		   !strcmp(version + len - 6, ".debug")) {
+		variant = version + len - 6;
+	} else {
+		variant = strrchr(version, '-');
+		for (len = 1; isalpha(variant[len]); len++) ;
+		if (len == 1 || variant[len])
+			variant = "";
+	}
+
+	if (asprintf(&flavor, "%.*s%s", (int)(version - name), name,
+		     variant) < 0)
+		return NULL;
+	return flavor;
+}
+
+static int retainKeyCompare(const void *a, const void *b)
+{
+	const struct entrySortKey *ka = a, *kb = b;
+	int rc;
+
+	rc = strcmp(ka->flavor, kb->flavor);
+	if (rc)
+		return rc;
+	return entrySortKeyCompare(a, b);
+}
+
+/* Remove all but the keep newest kernels of each flavor, newest the way
+ * rpm-sort orders them. The default entry stays, whatever its version, and
+ * so do the entries which aren't for a Linux kernel. */
+static int retainKernels(struct grubConfig *cfg, int keep)
+{
+	struct singleEntry *entry, *defEntry = NULL, *fallbackEntry = NULL;
+	struct entrySortKey *keys;
+	struct singleLine *line;
+	const char *name;
+	int n = 0, i, rank = 0;
+
+	if (cfg->defaultImage >= FIRST_ENTRY_INDEX)
+		defEntry = outputIndexEntry(cfg, cfg->defaultImage);
+	if (cfg->fallbackImage >= 0)
+		fallbackEntry = outputIndexEntry(cfg, cfg->fallbackImage);
+
+	for (entry = cfg->entries; entry; entry = entry->next)
+		n++;
+	keys = calloc(n, sizeof(*keys));
+	if (!keys)
+		return 1;
+
+	n = 0;
+	for (entry = cfg->entries; entry; entry = entry->next) {
+		if (entry->skip || entry->multiboot)
+			continue;
+		line = getEntryLineByType(LT_KERNEL | LT_KERNEL_EFI |
+					  LT_KERNEL_16, entry);
+		if (!line || line->numElements < 2)
+			continue;
+
+		name = strrchr(line->elements[1].item, '/');
+		name = name ? name + 1 : line->elements[1].item;
+		keys[n].flavor = kernelFlavor(name);
+		if (!keys[n].flavor || nvr_init(&keys[n].nvr, name)) {
+			free(keys[n].flavor);
+			continue;
+		}
+		keys[n].entry = entry;
+		keys[n].hasKernel = 1;
+		keys[n].pos = n;
+		n++;
+	}
+
+	qsort(keys, n, sizeof(*keys), retainKeyCompare);
+
+	for (i = 0; i < n; i++) {
+		/* entries for the same kernel count once */
+		if (!i || strcmp(keys[i].flavor, keys[i - 1].flavor))
+			rank = 1;
+		else if (nvr_compare(&keys[i].nvr, &keys[i - 1].nvr,
+				     nvr_rpmvercmp))
+			rank++;
+
+		if (rank > keep && keys[i].entry != defEntry) {
+			dbgPrintf("--retain removes %s entry %d\n",
+				  keys[i].flavor, keys[i].pos);
+			keys[i].entry->skip = 1;
+		}
+	}
+
+	for (i = 0; i < n; i++) {
+		nvr_fini(&keys[i].nvr);
+		free(keys[i].flavor);
+	}
+	free(keys);
+
+	if (defEntry)
+		cfg->defaultImage = entryOutputIndex(cfg, defEntry);
+	if (fallbackEntry)
+		cfg->fallbackImage = fallbackEntry->skip ? -1 :
+		    entryOutputIndex(cfg, fallbackEntry);
+
+	return 0;
+}
+
 void displayEntry(struct grubConfig *config, struct singleEntry *entry, const char *prefix, int index)
 {
 	struct singleLine *line;
@@ -2862,8 +5751,8 @@ void displayEntry(struct grubConfig *config, struct singleEntry *entry, const ch
 	printf("index=%d\n", index);
 
 	line =
-	    getLineByType(LT_KERNEL | LT_HYPER | LT_KERNEL_EFI | LT_KERNEL_16,
-			  entry->lines);
+	    getEntryLineByType(LT_KERNEL | LT_HYPER | LT_KERNEL_EFI | LT_KERNEL_16,
+			  entry);
 	if (!line) {
 		printf("non linux entry\n");
 		return;
@@ -2889,7 +5778,7 @@ void displayEntry(struct grubConfig *config, struct singleEntry *entry, const ch
 		}
 		printf("\"\n");
 	} else {
-		line = getLineByType(LT_KERNELARGS, entry->lines);
+		line = getEntryLineByType(LT_KERNELARGS, entry);
 		if (line) {
 			char *s;
 
@@ -2915,7 +5804,7 @@ void displayEntry(struct grubConfig *config, struct singleEntry *entry, const ch
 	}
 
 	if (!root) {
-		line = getLineByType(LT_ROOT, entry->lines);
+		line = getEntryLineByType(LT_ROOT, entry);
 		if (line && line->numElements >= 2)
 			root = line->elements[1].item;
 	}
@@ -2931,8 +5820,8 @@ void displayEntry(struct grubConfig *config, struct singleEntry *entry, const ch
 	}
 
 	line =
-	    getLineByType(LT_INITRD | LT_INITRD_EFI | LT_INITRD_16,
-			  entry->lines);
+	    getEntryLineByType(LT_INITRD | LT_INITRD_EFI | LT_INITRD_16,
+			  entry);
 
 	if (line && line->numElements >= 2) {
 		if (!strncmp(prefix, line->elements[1].item, strlen(prefix)))
@@ -2946,7 +5835,7 @@ void displayEntry(struct grubConfig *config, struct singleEntry *entry, const ch
 		printf("\n");
 	}
 
-	line = getLineByType(LT_TITLE, entry->lines);
+	line = getEntryLineByType(LT_TITLE, entry);
 	if (line) {
                 char *entryTitle;
                 /* if we can extractTitle, then it's a zipl config and
@@ -2958,7 +5847,7 @@ void displayEntry(struct grubConfig *config, struct singleEntry *entry, const ch
 		printf("title=%s\n", entryTitle);
 	} else {
 		char *title;
-		line = getLineByType(LT_MENUENTRY, entry->lines);
+		line = getEntryLineByType(LT_MENUENTRY, entry);
 		if (line) {
 			title = grub2ExtractTitle(line);
 			if (title)
@@ -3345,18 +6234,10 @@ void dumpSysconfigGrub(void)
 	}
 }
 
-int displayInfo(struct grubConfig *config, char *kernel, const char *prefix)
+static void displayInfoHeader(struct grubConfig *config)
 {
-	int i = 0;
-	struct singleEntry *entry;
 	struct singleLine *line;
 
-	entry = findEntryByPath(config, kernel, prefix, &i);
-	if (!entry) {
-		fprintf(stderr, _("grubby: kernel not found\n"));
-		return 1;
-	}
-
 	/* this is a horrible hack to support /etc/sysconfig/grub; there must
 	   be a better way */
 	if (config->cfi == &grubConfigType) {
@@ -3371,7 +6252,54 @@ int displayInfo(struct grubConfig *config, char *kernel, const char *prefix)
 		if (line)
 			printf("lba\n");
 	}
+}
+
+struct streamInfoState {
+	const char *prefix;
+	int numEntries;
+};
+
+static void displayStreamedEntry(struct grubConfig *config,
+				 struct singleEntry *entry, int index,
+				 void *data)
+{
+	struct streamInfoState *state = data;
+
+	/* the header goes out with the first entry, like displayInfo() */
+	if (!state->numEntries++)
+		displayInfoHeader(config);
+	displayEntry(config, entry, state->prefix, index);
+}
+
+/* --info=ALL, printing each entry as soon as it has been read instead of
+ * reading the whole config first */
+static int streamInfo(const char *inName, struct configFileInfo *cfi,
+		      const char *prefix)
+{
+	struct streamInfoState state = { prefix, 0 };
+
+	if (!readConfigStream(inName, cfi, displayStreamedEntry, &state))
+		return 1;
+
+	if (!state.numEntries) {
+		fprintf(stderr, _("grubby: kernel not found\n"));
+		return 1;
+	}
+	return 0;
+}
+
+int displayInfo(struct grubConfig *config, char *kernel, const char *prefix)
+{
+	int i = 0;
+	struct singleEntry *entry;
+
+	entry = findEntryByPath(config, kernel, prefix, &i);
+	if (!entry) {
+		fprintf(stderr, _("grubby: kernel not found\n"));
+		return 1;
+	}
 
+	displayInfoHeader(config);
 	displayEntry(config, entry, prefix, i);
 
 	i++;
@@ -3442,6 +6370,7 @@ struct singleLine *addLineTmpl(struct singleEntry *entry,
 		newLine->next = prevLine->next;
 		prevLine->next = newLine;
 	}
+	entry->lineTypes = -1;
 
 	return newLine;
 }
@@ -3531,7 +6460,7 @@ struct singleLine *addLine(struct singleEntry *entry,
 	}
 
 	struct singleLine *menuEntry;
-	menuEntry = getLineByType(LT_MENUENTRY, entry->lines);
+	menuEntry = getEntryLineByType(LT_MENUENTRY, entry);
 	if (tmpl.type == LT_ENTRY_END) {
 		if (menuEntry)
 			tmpl.indent = menuEntry->indent;
@@ -3569,6 +6498,7 @@ void removeLine(struct singleEntry *entry, struct singleLine *line)
 			prev = prev->next;
 		prev->next = line->next;
 	}
+	entry->lineTypes = -1;
 
 	free(line);
 }
@@ -3580,140 +6510,180 @@ static void requote(struct singleLine *tmplLine, struct configFileInfo *cfi)
 		.type = tmplLine->type,
 		.next = tmplLine->next,
 	};
-	int firstQuotedItem = -1;
-	int quoteLen = 0;
+	int inQuote = 0;
 	int j;
 	int element = 0;
-	char *c;
+	struct strBuf quoted = { 0 };
 
-	c = malloc(strlen(tmplLine->elements[0].item) + 1);
-	strcpy(c, tmplLine->elements[0].item);
-	insertElement(&newLine, c, element++, cfi);
-	free(c);
-	c = NULL;
+	insertElement(&newLine, tmplLine->elements[0].item, element++, cfi);
 
 	for (j = 1; j < tmplLine->numElements; j++) {
-		if (firstQuotedItem == -1) {
-			quoteLen += strlen(tmplLine->elements[j].item);
+		char *item = tmplLine->elements[j].item;
 
-			if (isquote(tmplLine->elements[j].item[0])) {
-				firstQuotedItem = j;
-				quoteLen +=
-				    strlen(tmplLine->elements[j].indent);
-			} else {
-				c = malloc(quoteLen + 1);
-				strcpy(c, tmplLine->elements[j].item);
-				insertElement(&newLine, c, element++, cfi);
-				free(c);
-				quoteLen = 0;
-			}
-		} else {
-			int itemlen = strlen(tmplLine->elements[j].item);
-			quoteLen += itemlen;
-			quoteLen += strlen(tmplLine->elements[j].indent);
-
-			if (isquote(tmplLine->elements[j].item[itemlen - 1])) {
-				c = malloc(quoteLen + 1);
-				c[0] = '\0';
-				for (int i = firstQuotedItem; i < j + 1; i++) {
-					strcat(c, tmplLine->elements[i].item);
-					strcat(c, tmplLine->elements[i].indent);
-				}
-				insertElement(&newLine, c, element++, cfi);
-				free(c);
+		if (!inQuote && !isquote(item[0])) {
+			insertElement(&newLine, item, element++, cfi);
+			continue;
+		}
 
-				firstQuotedItem = -1;
-				quoteLen = 0;
-			}
+		strBufAppend(&quoted, item);
+		strBufAppend(&quoted, tmplLine->elements[j].indent);
+
+		if (!inQuote) {
+			inQuote = 1;
+		} else if (isquote(item[strlen(item) - 1])) {
+			insertElement(&newLine, quoted.str, element++, cfi);
+			strBufReset(&quoted);
+			inQuote = 0;
 		}
 	}
-	while (tmplLine->numElements)
-		removeElement(tmplLine, 0);
+	free(quoted.str);
+	for (j = 0; j < tmplLine->numElements; j++) {
+		free(tmplLine->elements[j].item);
+		free(tmplLine->elements[j].indent);
+	}
 	if (tmplLine->elements)
 		free(tmplLine->elements);
 
 	tmplLine->numElements = newLine.numElements;
+	tmplLine->elementsAlloced = newLine.elementsAlloced;
 	tmplLine->elements = newLine.elements;
 }
 
-static void insertElement(struct singleLine *line,
-			  const char *item, int insertHere,
-			  struct configFileInfo *cfi)
+/* make room for count more elements, growing the array geometrically */
+static void growElements(struct singleLine *line, int count)
 {
-	struct keywordTypes *kw;
-	char indent[2] = "";
+	int alloced = line->elementsAlloced ? line->elementsAlloced : 8;
 
-	/* sanity check */
-	if (insertHere > line->numElements) {
-		dbgPrintf
-		    ("insertElement() adjusting insertHere from %d to %d\n",
-		     insertHere, line->numElements);
-		insertHere = line->numElements;
-	}
+	if (line->numElements + count <= line->elementsAlloced)
+		return;
+
+	while (line->numElements + count > alloced)
+		alloced *= 2;
+	line->elements = realloc(line->elements,
+				 alloced * sizeof(*line->elements));
+	line->elementsAlloced = alloced;
+}
 
-	line->elements = realloc(line->elements, (line->numElements + 1) *
-				 sizeof(*line->elements));
-	memmove(&line->elements[insertHere + 1],
-		&line->elements[insertHere],
-		(line->numElements - insertHere) * sizeof(*line->elements));
-	line->elements[insertHere].item = strdup(item);
+/* Insert items[k] before element positions[k] for each k. The positions
+ * are those of the elements before anything is inserted, in ascending
+ * order; items with the same position are inserted in the order given.
+ * The result is the same as calling insertElement() for each of them in
+ * turn (adjusting the positions for what's been inserted already), but
+ * each existing element is moved only once. */
+static void insertElements(struct singleLine *line, const char **items,
+			   const int *positions, int count,
+			   struct configFileInfo *cfi)
+{
+	struct keywordTypes *kw;
+	int numElements = line->numElements;
+	int end = numElements;
+	int insertHere;
+
+	growElements(line, count);
+
+	for (int k = count - 1; k >= 0; k--) {
+		insertHere = positions[k];
+		/* sanity check */
+		if (insertHere > numElements) {
+			dbgPrintf("insertElements() adjusting insertHere "
+				  "from %d to %d\n", insertHere, numElements);
+			insertHere = numElements;
+		}
+		memmove(&line->elements[insertHere + k + 1],
+			&line->elements[insertHere],
+			(end - insertHere) * sizeof(*line->elements));
+		end = insertHere;
+	}
 
 	kw = getKeywordByType(line->type, cfi);
 
-	if (line->numElements == 0) {
-		indent[0] = '\0';
-	} else if (insertHere == 0) {
-		indent[0] = kw->nextChar;
-	} else if (kw->separatorChar != '\0') {
-		indent[0] = kw->separatorChar;
-	} else {
-		indent[0] = ' ';
-	}
+	for (int k = 0; k < count; k++, line->numElements++) {
+		char indent[2] = "";
 
-	if (insertHere > 0 && line->elements[insertHere - 1].indent[0] == '\0') {
-		/* move the end-of-line forward */
-		line->elements[insertHere].indent =
-		    line->elements[insertHere - 1].indent;
-		line->elements[insertHere - 1].indent = strdup(indent);
-	} else {
-		line->elements[insertHere].indent = strdup(indent);
-	}
+		insertHere = (positions[k] > numElements ? numElements :
+			      positions[k]) + k;
+		line->elements[insertHere].item = strdup(items[k]);
+
+		if (line->numElements == 0) {
+			indent[0] = '\0';
+		} else if (insertHere == 0) {
+			indent[0] = kw->nextChar;
+		} else if (kw->separatorChar != '\0') {
+			indent[0] = kw->separatorChar;
+		} else {
+			indent[0] = ' ';
+		}
 
-	line->numElements++;
+		if (insertHere > 0 &&
+		    line->elements[insertHere - 1].indent[0] == '\0') {
+			/* move the end-of-line forward */
+			line->elements[insertHere].indent =
+			    line->elements[insertHere - 1].indent;
+			line->elements[insertHere - 1].indent = strdup(indent);
+		} else {
+			line->elements[insertHere].indent = strdup(indent);
+		}
 
-	dbgPrintf("insertElement(%s, '%s%s', %d)\n",
-		  line->elements[0].item,
-		  line->elements[insertHere].item,
-		  line->elements[insertHere].indent, insertHere);
+		dbgPrintf("insertElement(%s, '%s%s', %d)\n",
+			  line->elements[0].item,
+			  line->elements[insertHere].item,
+			  line->elements[insertHere].indent, insertHere);
+	}
 }
 
-static void removeElement(struct singleLine *line, int removeHere)
+static void insertElement(struct singleLine *line,
+			  const char *item, int insertHere,
+			  struct configFileInfo *cfi)
 {
-	int i;
+	insertElements(line, &item, &insertHere, 1, cfi);
+}
 
-	/* sanity check */
-	if (removeHere >= line->numElements)
-		return;
+/* Remove the elements at positions, which are in ascending order. This is
+ * the same as calling removeElement() on each of them starting from the
+ * last one, but the array is only collapsed once. */
+static void removeElements(struct singleLine *line, const int *positions,
+			   int count)
+{
+	int removeHere, i, k;
 
-	dbgPrintf("removeElement(%s, %d:%s)\n", line->elements[0].item,
-		  removeHere, line->elements[removeHere].item);
+	for (k = count - 1; k >= 0; k--) {
+		removeHere = positions[k];
 
-	free(line->elements[removeHere].item);
+		dbgPrintf("removeElement(%s, %d:%s)\n",
+			  line->elements[0].item, removeHere,
+			  line->elements[removeHere].item);
 
-	if (removeHere > 1) {
-		/* previous argument gets this argument's post-indentation */
-		free(line->elements[removeHere - 1].indent);
-		line->elements[removeHere - 1].indent =
-		    line->elements[removeHere].indent;
-	} else {
-		free(line->elements[removeHere].indent);
+		free(line->elements[removeHere].item);
+
+		if (removeHere > 1) {
+			/* previous argument gets this argument's
+			 * post-indentation */
+			free(line->elements[removeHere - 1].indent);
+			line->elements[removeHere - 1].indent =
+			    line->elements[removeHere].indent;
+		} else {
+			free(line->elements[removeHere].indent);
+		}
 	}
 
 	/* now collapse the array, but don't bother to realloc smaller */
-	for (i = removeHere; i < line->numElements - 1; i++)
-		line->elements[i] = line->elements[i + 1];
+	for (i = positions[0], k = 0; i < line->numElements; i++) {
+		if (k < count && i == positions[k])
+			k++;
+		else
+			line->elements[i - k] = line->elements[i];
+	}
+
+	line->numElements -= count;
+}
+
+static void removeElement(struct singleLine *line, int removeHere)
+{
+	/* sanity check */
+	if (removeHere >= line->numElements)
+		return;
 
-	line->numElements--;
+	removeElements(line, &removeHere, 1);
 }
 
 static int argNameMatch(const char *one, const char *two)
@@ -3779,20 +6749,235 @@ static int argValueMatch(const char *one, const char *two)
 		return strcmp(chptra, chptrb);
 }
 
+/* Apply the arguments to add and remove to line, whose arguments start at
+ * firstElement. The root= arguments also update the LT_ROOT line of entry
+ * if useRoot is set. insertItems and positions have room for all the
+ * arguments. */
+static void updateArgsLine(struct grubConfig *cfg, struct singleEntry *entry,
+			   struct singleLine *line, int firstElement,
+			   const char **newArgs, const char **oldArgs,
+			   int multibootArgs, int useRoot,
+			   const char **insertItems, int *positions)
+{
+	struct singleLine *rootLine;
+	const char **arg;
+	int *usedElements;
+	int doreplace;
+	int numInserts, numRemoves;
+	int i, k;
+
+	/* new args are only inserted once they've all been looked at,
+	 * they can't be replaced by the ones after them anyway */
+	usedElements = calloc(line->numElements, sizeof(*usedElements));
+	numInserts = 0;
+
+	for (k = 0, arg = newArgs; *arg; arg++, k++) {
+
+		doreplace = 1;
+		for (i = firstElement; i < line->numElements; i++) {
+			if (multibootArgs && cfg->cfi->mbConcatArgs &&
+			    !strcmp(line->elements[i].item, "--")) {
+				/* reached the end of hyper args, insert here */
+				doreplace = 0;
+				break;
+			}
+			if (usedElements[i])
+				continue;
+			if (!argNameMatch(line->elements[i].item, *arg)) {
+				usedElements[i] = 1;
+				break;
+			}
+		}
+
+		if (i < line->numElements && doreplace) {
+			/* direct replacement */
+			free(line->elements[i].item);
+			line->elements[i].item = strdup(*arg);
+
+		} else if (useRoot && !strncmp(*arg, "root=/dev/", 10)) {
+			/* root= replacement */
+			rootLine = getEntryLineByType(LT_ROOT, entry);
+			if (rootLine) {
+				free(rootLine->elements[1].item);
+				rootLine->elements[1].item = strdup(*arg + 5);
+			} else {
+				rootLine = addLine(entry, cfg->cfi, LT_ROOT,
+						   cfg->secondaryIndent,
+						   *arg + 5);
+			}
+		}
+
+		else {
+			/* insert/append; if we stopped at the --, an
+			 * earlier -- arg would have been found first,
+			 * so go before that one */
+			for (k = 0; k < numInserts && positions[k] <= i; k++) {
+				if (!doreplace && positions[k] == i &&
+				    !strcmp(insertItems[k], "--"))
+					break;
+			}
+			memmove(&insertItems[k + 1], &insertItems[k],
+				(numInserts - k) * sizeof(*insertItems));
+			memmove(&positions[k + 1], &positions[k],
+				(numInserts - k) * sizeof(*positions));
+			insertItems[k] = *arg;
+			positions[k] = i;
+			numInserts++;
+
+			/* if we updated a root= here even though
+			 * there is a LT_ROOT available we need to
+			 * remove the LT_ROOT entry (this will happen
+			 * if we switch from a device to a label) */
+			if (useRoot && !strncmp(*arg, "root=", 5)) {
+				rootLine = getEntryLineByType(LT_ROOT, entry);
+				if (rootLine)
+					removeLine(entry, rootLine);
+			}
+		}
+	}
+
+	if (numInserts)
+		insertElements(line, insertItems, positions, numInserts,
+			       cfg->cfi);
+	free(usedElements);
+
+	/* likewise the args to remove are only marked as they're found,
+	 * and then removed all at once */
+	usedElements = calloc(line->numElements, sizeof(*usedElements));
+	numRemoves = 0;
+
+	for (arg = oldArgs; *arg; arg++) {
+		for (i = firstElement; i < line->numElements; i++) {
+			if (multibootArgs && cfg->cfi->mbConcatArgs &&
+			    !strcmp(line->elements[i].item, "--"))
+				/* reached the end of hyper args, stop here */
+				break;
+			if (usedElements[i])
+				continue;
+			if (!argNameMatch(line->elements[i].item, *arg)) {
+				if (!argHasValue(*arg) ||
+				    !argValueMatch(line->elements[i].item, *arg)) {
+					usedElements[i] = 1;
+					numRemoves++;
+					break;
+				}
+			}
+		}
+		/* handle removing LT_ROOT line too */
+		if (useRoot && !strncmp(*arg, "root=", 5)) {
+			rootLine = getEntryLineByType(LT_ROOT, entry);
+			if (rootLine)
+				removeLine(entry, rootLine);
+		}
+	}
+
+	for (i = 0, k = 0; k < numRemoves; i++) {
+		if (usedElements[i])
+			positions[k++] = i;
+	}
+	if (numRemoves)
+		removeElements(line, positions, numRemoves);
+	free(usedElements);
+}
+
+/* is item a reference to the kernelopts variable */
+static int isKernelOptsRef(const char *item)
+{
+	return !strcmp(item, "$" KERNELOPTS) ||
+	    !strcmp(item, "${" KERNELOPTS "}");
+}
+
+/* Entries may take all of their arguments from the kernelopts variable in
+ * the environment block, the way the BLS entries on Fedora do. If every
+ * entry does, the arguments are changed in the variable, once, instead of
+ * in each of the entries; the new value is written along with the config.
+ * Returns 1 if that's what happened. */
+static int updateKernelOpts(struct grubConfig *cfg, const char *prefix,
+			    const char **newArgs, const char **oldArgs,
+			    const char **insertItems, int *positions)
+{
+	struct configFileInfo *cfi = cfg->cfi;
+	struct singleEntry *entry;
+	struct singleLine *line;
+	struct strBuf value = { 0 };
+	const char *opts, *start, *end;
+	int firstElement, index = 0, numKernels = 0;
+
+	if (!cfi->getEnv || !cfi->setEnv)
+		return 0;
+
+	for (; (entry = findEntryByPath(cfg, "ALL", prefix, &index)); index++) {
+		line = getEntryLineByType(LT_KERNEL | LT_KERNEL_EFI |
+					  LT_KERNEL_16, entry);
+		if (!line)
+			continue;
+		firstElement = 2;
+
+		if (getKeywordByType(LT_KERNELARGS, cfi)) {
+			line = getEntryLineByType(LT_KERNELARGS, entry);
+			firstElement = 1;
+		}
+		if (!line || line->numElements != firstElement + 1 ||
+		    !isKernelOptsRef(line->elements[firstElement].item))
+			return 0;
+		numKernels++;
+	}
+	if (!numKernels)
+		return 0;
+
+	opts = getKernelOpts(cfg);
+	if (!opts)
+		return 0;
+
+	/* the value gets the same treatment as the args of an entry */
+	line = malloc(sizeof(*line));
+	lineInit(line);
+	line->type = firstElement == 1 ? LT_KERNELARGS : LT_KERNEL;
+	line->indent = strdup("");
+	growElements(line, 1);
+	line->elements[0].item = strdup(KERNELOPTS);
+	line->elements[0].indent = strdup(" ");
+	line->numElements = 1;
+
+	for (start = opts + strspn(opts, " \t"); *start;
+	     start = end + strspn(end, " \t")) {
+		end = start + strcspn(start, " \t");
+		growElements(line, 1);
+		line->elements[line->numElements].item =
+		    strndup(start, end - start);
+		line->elements[line->numElements].indent = strdup(" ");
+		line->numElements++;
+	}
+
+	updateArgsLine(cfg, NULL, line, 1, newArgs, oldArgs, 0, 0,
+		       insertItems, positions);
+
+	for (int i = 1; i < line->numElements; i++) {
+		if (i > 1)
+			strBufAppend(&value, " ");
+		strBufAppend(&value, line->elements[i].item);
+	}
+	lineFree(line);
+
+	free(cfg->kernelOpts);
+	cfg->kernelOpts = strBufFinish(&value);
+	return 1;
+}
+
 int updateActualImage(struct grubConfig *cfg, const char *image,
 		      const char *prefix, const char *addArgs,
 		      const char *removeArgs, int multibootArgs)
 {
 	struct singleEntry *entry;
-	struct singleLine *line, *rootLine;
+	struct singleLine *line;
 	int index = 0;
 	int i, k;
 	const char **newArgs, **oldArgs;
-	const char **arg;
 	int useKernelArgs, useRoot;
 	int firstElement;
-	int *usedElements;
-	int doreplace;
+	const char **insertItems;
+	int *positions;
+	int numArgs;
 
 	if (!image)
 		return 0;
@@ -3822,12 +7007,24 @@ int updateActualImage(struct grubConfig *cfg, const char *image,
 		}
 	}
 
+	for (numArgs = 0; newArgs[numArgs]; numArgs++) ;
+	for (i = 0; oldArgs[i]; i++) ;
+	if (i > numArgs)
+		numArgs = i;
+	insertItems = malloc(sizeof(*insertItems) * (numArgs + 1));
+	positions = malloc(sizeof(*positions) * (numArgs + 1));
+
 	useKernelArgs = (getKeywordByType(LT_KERNELARGS, cfg->cfi)
 			 && (!multibootArgs || cfg->cfi->mbConcatArgs));
 
 	useRoot = (getKeywordByType(LT_ROOT, cfg->cfi)
 		   && !multibootArgs);
 
+	if (!multibootArgs && !strcmp(image, "ALL") &&
+	    updateKernelOpts(cfg, prefix, newArgs, oldArgs, insertItems,
+			     positions))
+		goto out;
+
 	for (; (entry = findEntryByPath(cfg, image, prefix, &index)); index++) {
 
 		if (multibootArgs && !entry->multiboot)
@@ -3838,7 +7035,7 @@ int updateActualImage(struct grubConfig *cfg, const char *image,
 		 * LT_HYPER/LT_KERNEL/LT_MBMODULE lines.
 		 */
 		if (useKernelArgs) {
-			line = getLineByType(LT_KERNELARGS, entry->lines);
+			line = getEntryLineByType(LT_KERNELARGS, entry);
 			if (!line) {
 				/* no LT_KERNELARGS, need to add it */
 				line = addLine(entry, cfg->cfi, LT_KERNELARGS,
@@ -3847,7 +7044,7 @@ int updateActualImage(struct grubConfig *cfg, const char *image,
 			firstElement = 1;
 
 		} else if (multibootArgs) {
-			line = getLineByType(LT_HYPER, entry->lines);
+			line = getEntryLineByType(LT_HYPER, entry);
 			if (!line) {
 				/* a multiboot entry without LT_HYPER? */
 				continue;
@@ -3856,9 +7053,9 @@ int updateActualImage(struct grubConfig *cfg, const char *image,
 
 		} else {
 			line =
-			    getLineByType(LT_KERNEL | LT_MBMODULE |
+			    getEntryLineByType(LT_KERNEL | LT_MBMODULE |
 					  LT_KERNEL_EFI | LT_KERNEL_16,
-					  entry->lines);
+					  entry);
 			if (!line) {
 				/* no LT_KERNEL or LT_MBMODULE in this entry? */
 				continue;
@@ -3896,104 +7093,19 @@ int updateActualImage(struct grubConfig *cfg, const char *image,
 					break;
 			}
 			if (i < line->numElements) {
-				/* remove args up to -- */
-				while (strcmp
-				       (line->elements[firstElement].item,
-					"--"))
-					removeElement(line, firstElement);
-				/* remove -- */
-				removeElement(line, firstElement);
-			}
-		}
-
-		usedElements = calloc(line->numElements, sizeof(*usedElements));
-
-		for (k = 0, arg = newArgs; *arg; arg++, k++) {
-
-			doreplace = 1;
-			for (i = firstElement; i < line->numElements; i++) {
-				if (multibootArgs && cfg->cfi->mbConcatArgs &&
-				    !strcmp(line->elements[i].item, "--")) {
-					/* reached the end of hyper args, insert here */
-					doreplace = 0;
-					break;
-				}
-				if (usedElements[i])
-					continue;
-				if (!argNameMatch(line->elements[i].item, *arg)) {
-					usedElements[i] = 1;
-					break;
-				}
-			}
-
-			if (i < line->numElements && doreplace) {
-				/* direct replacement */
-				free(line->elements[i].item);
-				line->elements[i].item = strdup(*arg);
-
-			} else if (useRoot && !strncmp(*arg, "root=/dev/", 10)) {
-				/* root= replacement */
-				rootLine = getLineByType(LT_ROOT, entry->lines);
-				if (rootLine) {
-					free(rootLine->elements[1].item);
-					rootLine->elements[1].item =
-					    strdup(*arg + 5);
-				} else {
-					rootLine =
-					    addLine(entry, cfg->cfi, LT_ROOT,
-						    cfg->secondaryIndent,
-						    *arg + 5);
-				}
-			}
-
-			else {
-				/* insert/append */
-				insertElement(line, *arg, i, cfg->cfi);
-				usedElements =
-				    realloc(usedElements,
-					    line->numElements *
-					    sizeof(*usedElements));
-				memmove(&usedElements[i + 1], &usedElements[i],
-					line->numElements - i - 1);
-				usedElements[i] = 1;
-
-				/* if we updated a root= here even though
-				 * there is a LT_ROOT available we need to
-				 * remove the LT_ROOT entry (this will happen
-				 * if we switch from a device to a label) */
-				if (useRoot && !strncmp(*arg, "root=", 5)) {
-					rootLine =
-					    getLineByType(LT_ROOT,
-							  entry->lines);
-					if (rootLine)
-						removeLine(entry, rootLine);
-				}
+				/* remove args up to and including -- */
+				int *run = malloc(sizeof(*run) *
+						  (i - firstElement + 1));
+
+				for (k = firstElement; k <= i; k++)
+					run[k - firstElement] = k;
+				removeElements(line, run, i - firstElement + 1);
+				free(run);
 			}
 		}
 
-		free(usedElements);
-
-		for (arg = oldArgs; *arg; arg++) {
-			for (i = firstElement; i < line->numElements; i++) {
-				if (multibootArgs && cfg->cfi->mbConcatArgs &&
-				    !strcmp(line->elements[i].item, "--"))
-					/* reached the end of hyper args, stop here */
-					break;
-				if (!argNameMatch(line->elements[i].item, *arg)) {
-					if (!argHasValue(*arg) ||
-					    !argValueMatch(line->elements[i].item, *arg)) {
-						removeElement(line, i);
-						break;
-					}
-				}
-			}
-			/* handle removing LT_ROOT line too */
-			if (useRoot && !strncmp(*arg, "root=", 5)) {
-				rootLine = getLineByType(LT_ROOT, entry->lines);
-				if (rootLine)
-					removeLine(entry, rootLine);
-			}
-		}
+		updateArgsLine(cfg, entry, line, firstElement, newArgs, oldArgs,
+			       multibootArgs, useRoot, insertItems, positions);
 
 		if (line->numElements == 1) {
 			/* don't need the line at all (note it has to be a
@@ -4002,6 +7114,9 @@ int updateActualImage(struct grubConfig *cfg, const char *image,
 		}
 	}
 
+out:
+	free(insertItems);
+	free(positions);
 	free(newArgs);
 	free(oldArgs);
 
@@ -4044,7 +7159,7 @@ int addMBInitrd(struct grubConfig *cfg, const char *newMBKernel,
 		return 0;
 
 	for (; (entry = findEntryByPath(cfg, image, prefix, &index)); index++) {
-		kernelLine = getLineByType(LT_MBMODULE, entry->lines);
+		kernelLine = getEntryLineByType(LT_MBMODULE, entry);
 		if (!kernelLine)
 			continue;
 
@@ -4053,8 +7168,8 @@ int addMBInitrd(struct grubConfig *cfg, const char *newMBKernel,
 			char *linetitle;
 
 			line =
-			    getLineByType(LT_TITLE | LT_MENUENTRY,
-					  entry->lines);
+			    getEntryLineByType(LT_TITLE | LT_MENUENTRY,
+					  entry);
 			if (!line)
 				continue;
 
@@ -4073,7 +7188,7 @@ int addMBInitrd(struct grubConfig *cfg, const char *newMBKernel,
 			if (!strncmp(initrd, prefix, prefixLen))
 				initrd += prefixLen;
 		}
-		endLine = getLineByType(LT_ENTRY_END, entry->lines);
+		endLine = getEntryLineByType(LT_ENTRY_END, entry);
 		if (endLine)
 			removeLine(entry, endLine);
 		line =
@@ -4106,8 +7221,8 @@ int updateInitrd(struct grubConfig *cfg, const char *image,
 
 	for (; (entry = findEntryByPath(cfg, image, prefix, &index)); index++) {
 		kernelLine =
-		    getLineByType(LT_KERNEL | LT_KERNEL_EFI | LT_KERNEL_16,
-				  entry->lines);
+		    getEntryLineByType(LT_KERNEL | LT_KERNEL_EFI | LT_KERNEL_16,
+				  entry);
 		if (!kernelLine)
 			continue;
 
@@ -4116,8 +7231,8 @@ int updateInitrd(struct grubConfig *cfg, const char *image,
 			char *linetitle;
 
 			line =
-			    getLineByType(LT_TITLE | LT_MENUENTRY,
-					  entry->lines);
+			    getEntryLineByType(LT_TITLE | LT_MENUENTRY,
+					  entry);
 			if (!line)
 				continue;
 
@@ -4132,8 +7247,8 @@ int updateInitrd(struct grubConfig *cfg, const char *image,
 		}
 
 		line =
-		    getLineByType(LT_INITRD | LT_INITRD_EFI | LT_INITRD_16,
-				  entry->lines);
+		    getEntryLineByType(LT_INITRD | LT_INITRD_EFI | LT_INITRD_16,
+				  entry);
 		if (line)
 			removeLine(entry, line);
 		if (prefix) {
@@ -4141,7 +7256,7 @@ int updateInitrd(struct grubConfig *cfg, const char *image,
 			if (!strncmp(initrd, prefix, prefixLen))
 				initrd += prefixLen;
 		}
-		endLine = getLineByType(LT_ENTRY_END, entry->lines);
+		endLine = getEntryLineByType(LT_ENTRY_END, entry);
 		if (endLine)
 			removeLine(entry, endLine);
 		enum lineType_e lt;
@@ -4173,26 +7288,72 @@ int updateInitrd(struct grubConfig *cfg, const char *image,
 	return 0;
 }
 
-int checkDeviceBootloader(const char *device, const unsigned char *boot)
+/* The boot sectors of the devices looked at so far; the raid members are
+ * read on a thread each, so entries are only added by the main thread. */
+struct bootSector {
+	char *device;
+	unsigned char sect[512];
+	int failed;		/* 0, or 1 if open() and 2 if read() failed */
+	int err;		/* errno from what failed */
+	struct bootSector *next;
+};
+
+static struct bootSector *bootSectors = NULL;
+
+static void *readBootSector(void *data)
 {
+	struct bootSector *bs = data;
 	int fd;
-	unsigned char bootSect[512];
-	int offset;
 
-	fd = open(device, O_RDONLY);
+	fd = open(bs->device, O_RDONLY);
 	if (fd < 0) {
-		fprintf(stderr, _("grubby: unable to open %s: %s\n"),
-			device, strerror(errno));
-		return 1;
+		bs->failed = 1;
+		bs->err = errno;
+		return NULL;
 	}
 
-	if (read(fd, bootSect, 512) != 512) {
+	if (read(fd, bs->sect, 512) != 512) {
+		bs->failed = 2;
+		bs->err = errno;
+	}
+	close(fd);
+
+	return NULL;
+}
+
+/* find the cached boot sector of device, or add it without reading it */
+static struct bootSector *findBootSector(const char *device, int *added)
+{
+	struct bootSector *bs;
+
+	for (bs = bootSectors; bs; bs = bs->next) {
+		if (!strcmp(bs->device, device))
+			return bs;
+	}
+
+	bs = calloc(1, sizeof(*bs));
+	bs->device = strdup(device);
+	bs->next = bootSectors;
+	bootSectors = bs;
+	*added = 1;
+
+	return bs;
+}
+
+static int checkBootSector(struct bootSector *bs, const unsigned char *boot)
+{
+	const unsigned char *bootSect = bs->sect;
+	int offset;
+
+	if (bs->failed == 1) {
+		fprintf(stderr, _("grubby: unable to open %s: %s\n"),
+			bs->device, strerror(bs->err));
+		return 1;
+	} else if (bs->failed) {
 		fprintf(stderr, _("grubby: unable to read %s: %s\n"),
-			device, strerror(errno));
-		close(fd);
+			bs->device, strerror(bs->err));
 		return 1;
 	}
-	close(fd);
 
 	/* first three bytes should match, a jmp short should be in there */
 	if (memcmp(boot, bootSect, 3))
@@ -4226,14 +7387,99 @@ int checkDeviceBootloader(const char *device, const unsigned char *boot)
 	return 2;
 }
 
+int checkDeviceBootloader(const char *device, const unsigned char *boot)
+{
+	struct bootSector *bs;
+	int added = 0;
+
+	bs = findBootSector(device, &added);
+	if (added)
+		readBootSector(bs);
+
+	return checkBootSector(bs, boot);
+}
+
+/* Find the raw devices mdDev is made of in /proc/mdstat; returns the
+ * number of them, or -1 if there's no such raid device. */
+static int findRaidMembers(FILE *f, const char *mdDev, char ***members)
+{
+	char *line = NULL;
+	size_t n = 0;
+	char *chptr, *chptr2;
+	int numMembers = -1;
+
+	*members = NULL;
+
+	while (getline(&line, &n, f) > 0) {
+		chptr = line;
+		if (strncmp(chptr, mdDev, strlen(mdDev)) ||
+		    chptr[strlen(mdDev)] != ' ')
+			continue;
+
+		/* found the device */
+		numMembers = 0;
+		while (*chptr && *chptr != ':')
+			chptr++;
+		chptr++;
+		while (*chptr && isspace(*chptr))
+			chptr++;
+
+		/* skip the "active" bit */
+		while (*chptr && !isspace(*chptr))
+			chptr++;
+		while (*chptr && isspace(*chptr))
+			chptr++;
+
+		/* skip the raid level */
+		while (*chptr && !isspace(*chptr))
+			chptr++;
+		while (*chptr && isspace(*chptr))
+			chptr++;
+
+		/* everything else is partition stuff */
+		while (*chptr) {
+			chptr2 = chptr;
+			while (*chptr2 && *chptr2 != '[')
+				chptr2++;
+			if (!*chptr2)
+				break;
+
+			/* yank off the numbers at the end */
+			chptr2--;
+			while (isdigit(*chptr2) && chptr2 > chptr)
+				chptr2--;
+			chptr2++;
+			*chptr2 = '\0';
+
+			*members = realloc(*members, (numMembers + 1) *
+					   sizeof(**members));
+			(*members)[numMembers++] = sdupprintf("/dev/%s",
+							      chptr);
+
+			chptr = chptr2 + 1;
+			/* skip the [11] bit */
+			while (*chptr && !isspace(*chptr))
+				chptr++;
+			/* and move to the next one */
+			while (*chptr && isspace(*chptr))
+				chptr++;
+		}
+		break;
+	}
+	free(line);
+
+	return numMembers;
+}
+
 int checkLiloOnRaid(char *mdDev, const unsigned char *boot)
 {
-	int fd;
-	char buf[65536];
-	char *end;
-	char *chptr;
-	char *chptr2;
-	int rc;
+	FILE *f;
+	char **members;
+	struct bootSector **sectors;
+	pthread_t *threads;
+	int *started;		/* whether threads[i] is running */
+	int numMembers;
+	int rc = 2;
 
 	/* it's on raid; we need to parse /proc/mdstat and check all of the
 	 *raw* devices listed in there */
@@ -4241,96 +7487,66 @@ int checkLiloOnRaid(char *mdDev, const unsigned char *boot)
 	if (!strncmp(mdDev, "/dev/", 5))
 		mdDev += 5;
 
-	if ((fd = open("/proc/mdstat", O_RDONLY)) < 0) {
+	if (!(f = fopen("/proc/mdstat", "r"))) {
 		fprintf(stderr, _("grubby: failed to open /proc/mdstat: %s\n"),
 			strerror(errno));
 		return 2;
 	}
 
-	rc = read(fd, buf, sizeof(buf) - 1);
-	if (rc < 0 || rc == (sizeof(buf) - 1)) {
+	numMembers = findRaidMembers(f, mdDev, &members);
+	if (ferror(f)) {
 		fprintf(stderr, _("grubby: failed to read /proc/mdstat: %s\n"),
 			strerror(errno));
-		close(fd);
+		fclose(f);
+		for (int i = 0; i < numMembers; i++)
+			free(members[i]);
+		free(members);
 		return 2;
 	}
-	close(fd);
-	buf[rc] = '\0';
-
-	chptr = buf;
-	while (*chptr) {
-		end = strchr(chptr, '\n');
-		if (!end)
-			break;
-		*end = '\0';
-
-		if (!strncmp(chptr, mdDev, strlen(mdDev)) &&
-		    chptr[strlen(mdDev)] == ' ') {
-
-			/* found the device */
-			while (*chptr && *chptr != ':')
-				chptr++;
-			chptr++;
-			while (*chptr && isspace(*chptr))
-				chptr++;
-
-			/* skip the "active" bit */
-			while (*chptr && !isspace(*chptr))
-				chptr++;
-			while (*chptr && isspace(*chptr))
-				chptr++;
-
-			/* skip the raid level */
-			while (*chptr && !isspace(*chptr))
-				chptr++;
-			while (*chptr && isspace(*chptr))
-				chptr++;
+	fclose(f);
 
-			/* everything else is partition stuff */
-			while (*chptr) {
-				chptr2 = chptr;
-				while (*chptr2 && *chptr2 != '[')
-					chptr2++;
-				if (!*chptr2)
-					break;
+	if (numMembers < 0) {
+		fprintf(stderr,
+			_("grubby: raid device /dev/%s not found in "
+			  "/proc/mdstat\n"), mdDev);
+		return 0;
+	}
 
-				/* yank off the numbers at the end */
-				chptr2--;
-				while (isdigit(*chptr2) && chptr2 > chptr)
-					chptr2--;
-				chptr2++;
-				*chptr2 = '\0';
-
-				/* Better, now we need the /dev/ back. We're
-				 * done with everything before this point, so
-				 * we can just put the /dev/ part there.
-				 * There will always be room. */
-				memcpy(chptr - 5, "/dev/", 5);
-				rc = checkDeviceBootloader(chptr - 5, boot);
-				if (rc != 2) {
-					return rc;
-				}
+	/* read the boot sectors we don't have yet all at once, so a slow
+	 * disk doesn't hold up the others */
+	sectors = calloc(numMembers, sizeof(*sectors));
+	threads = calloc(numMembers, sizeof(*threads));
+	started = calloc(numMembers, sizeof(*started));
+	for (int i = 0; i < numMembers; i++) {
+		int added = 0;
 
-				chptr = chptr2 + 1;
-				/* skip the [11] bit */
-				while (*chptr && !isspace(*chptr))
-					chptr++;
-				/* and move to the next one */
-				while (*chptr && isspace(*chptr))
-					chptr++;
-			}
+		sectors[i] = findBootSector(members[i], &added);
+		if (!added)
+			continue;
+		if (pthread_create(&threads[i], NULL, readBootSector,
+				   sectors[i]))
+			/* no thread, just read it here */
+			readBootSector(sectors[i]);
+		else
+			started[i] = 1;
+	}
+	for (int i = 0; i < numMembers; i++) {
+		if (started[i])
+			pthread_join(threads[i], NULL);
+	}
 
-			/*  we're good to go */
-			return 2;
-		}
+	/* the first one which doesn't have our boot loader decides */
+	for (int i = 0; i < numMembers && rc == 2; i++)
+		rc = checkBootSector(sectors[i], boot);
 
-		chptr = end + 1;
-	}
+	for (int i = 0; i < numMembers; i++)
+		free(members[i]);
+	free(members);
+	free(sectors);
+	free(threads);
+	free(started);
 
-	fprintf(stderr,
-		_("grubby: raid device /dev/%s not found in /proc/mdstat\n"),
-		mdDev);
-	return 0;
+	return rc;
 }
 
 int checkForLilo(struct grubConfig *config)
@@ -4571,6 +7787,7 @@ int addNewKernel(struct grubConfig *config, struct singleEntry *template,
 	struct singleEntry *new, *entry, *prev = NULL;
 	struct singleLine *newLine = NULL, *tmplLine = NULL, *masterLine = NULL;
 	int needs;
+	int pos;		/* where new went in the list */
 	char *indexs;
 	char *chptr;
 	int rc;
@@ -4602,11 +7819,18 @@ int addNewKernel(struct grubConfig *config, struct singleEntry *template,
 	}
 
 	new = malloc(sizeof(*new));
+	new->unparsed = 0;
+	new->lineTypes = -1;
+	new->file = NULL;
+	new->fileText = NULL;
+	new->parent = NULL;
+	new->children = NULL;
+	new->numChildren = 0;
 	new->skip = 0;
 	new->multiboot = 0;
 	new->lines = NULL;
 	entry = config->entries;
-	for (unsigned int i = 0; i < newIndex; i++) {
+	for (pos = 0; pos < newIndex; pos++) {
 		if (!entry)
 			break;
 		prev = entry;
@@ -5008,7 +8232,7 @@ int addNewKernel(struct grubConfig *config, struct singleEntry *template,
 	}
 
 	struct singleLine *endLine = NULL;
-	endLine = getLineByType(LT_ENTRY_END, new->lines);
+	endLine = getEntryLineByType(LT_ENTRY_END, new);
 	if (endLine) {
 		removeLine(new, endLine);
 		needs |= NEED_END;
@@ -5080,6 +8304,8 @@ int addNewKernel(struct grubConfig *config, struct singleEntry *template,
 		abort();
 	}
 
+	entryIdsInserted(config, new, pos);
+
 	if (updateImage(config, indexs, prefix, newKernelArgs, NULL,
 			newMBKernelArgs, NULL)) {
 		config->isModified = 1;
@@ -5098,6 +8324,7 @@ int main(int argc, const char **argv)
 	int flags = 0;
 	int badImageOkay = 0;
 	int configureGrub2 = 0;
+	int configureBls = 0;
 	int configureLilo = 0, configureELilo = 0, configureGrub = 0;
 	int configureYaboot = 0, configureSilo = 0, configureZipl = 0;
 	int configureExtLinux = 0;
@@ -5130,6 +8357,9 @@ int main(int argc, const char **argv)
 	int displayDefaultIndex = 0;
 	int displayDefaultTitle = 0;
 	int defaultIndex = -1;
+	int sortByVersion = 0;
+	int removeStale = 0;
+	int retainCount = -1;
 	struct poptOption options[] = {
 		{"add-kernel", 0, POPT_ARG_STRING, &newKernelPath, 0,
 		 _("add an entry for the specified kernel"), _("kernel-path")},
@@ -5141,6 +8371,9 @@ int main(int argc, const char **argv)
 		{"mbargs", 0, POPT_ARG_STRING, &newMBKernelArgs, 0,
 		 _("default arguments for the new multiboot kernel or "
 		   "new arguments for multiboot kernel being updated"), NULL},
+		{"parse-jobs", 0, POPT_ARG_INT, &parseJobs, 0,
+		 _("number of threads used to parse the config, 1 to parse "
+		   "it sequentially (for testing only)"), _("jobs")},
 		{"mounts", 0, POPT_ARG_STRING, &mounts, 0,
 		 _("path to fake /proc/mounts file (for testing only)"),
 		 _("mounts")},
@@ -5148,6 +8381,9 @@ int main(int argc, const char **argv)
 		 _
 		 ("don't sanity check images in boot entries (for testing only)"),
 		 NULL},
+		{"bls", 0, POPT_ARG_NONE, &configureBls, 0,
+		 _("configure bls bootloader (BootLoaderSpec entries in "
+		   "/boot/loader/entries)")},
 		{"boot-filesystem", 0, POPT_ARG_STRING, &bootPrefix, 0,
 		 _
 		 ("filesystem which contains /boot directory (for testing only)"),
@@ -5173,6 +8409,9 @@ int main(int argc, const char **argv)
 		 _("display the index of the default kernel")},
 		{"default-title", 0, 0, &displayDefaultTitle, 0,
 		 _("display the title of the default kernel")},
+		{"diff", 0, POPT_ARG_NONE, &diffOutput, 0,
+		 _("print the changes as a unified diff instead of writing "
+		   "the config file")},
 		{"devtree", 0, POPT_ARG_STRING, &newDevTreePath, 0,
 		 _("device tree file for new stanza"), _("dtb-path")},
 		{"devtreedir", 0, POPT_ARG_STRING, &newDevTreePath, 0,
@@ -5216,12 +8455,20 @@ int main(int argc, const char **argv)
 		{"remove-multiboot", 0, POPT_ARG_STRING, &removeMBKernel, 0,
 		 _("remove all entries for the specified multiboot kernel"),
 		 NULL},
+		{"remove-stale", 0, 0, &removeStale, 0,
+		 _("remove the entries whose kernel, initrd or device tree "
+		   "is missing"), NULL},
+		{"retain", 0, POPT_ARG_INT, &retainCount, 0,
+		 _("remove all but the newest N kernels of each flavor, "
+		   "and the default"), _("N")},
 		{"set-default", 0, POPT_ARG_STRING, &defaultKernel, 0,
 		 _("make the first entry referencing the specified kernel "
 		   "the default"), _("kernel-path")},
 		{"set-default-index", 0, POPT_ARG_INT, &defaultIndex, 0,
 		 _("make the given entry index the default entry"),
 		 _("entry-index")},
+		{"sort-entries", 0, POPT_ARG_NONE, &sortByVersion, 0,
+		 _("order the boot entries by kernel version, newest first")},
 		{"set-index", 0, POPT_ARG_INT, &newIndex, 0,
 		 _("use the given index when creating a new entry"),
 		 _("entry-index")},
@@ -5306,7 +8553,7 @@ int main(int argc, const char **argv)
 
 	if ((configureLilo + configureGrub2 + configureGrub + configureELilo +
 	     configureYaboot + configureSilo + configureZipl +
-	     configureExtLinux) > 1) {
+	     configureExtLinux + configureBls) > 1) {
 		fprintf(stderr,
 			_("grubby: cannot specify multiple bootloaders\n"));
 		return 1;
@@ -5319,6 +8566,10 @@ int main(int argc, const char **argv)
 		cfi = &grub2ConfigType;
 		if (envPath)
 			cfi->envFile = envPath;
+	} else if (configureBls) {
+		cfi = &blsConfigType;
+		if (envPath)
+			cfi->envFile = envPath;
 	} else if (configureLilo) {
 		cfi = &liloConfigType;
 	} else if (configureGrub) {
@@ -5381,7 +8632,9 @@ int main(int argc, const char **argv)
 	}
 
 	if ((displayDefault || kernelInfo) && (newKernelPath ||
-					       removeKernelPath)) {
+					       removeKernelPath ||
+					       removeStale ||
+					       retainCount != -1)) {
 		fprintf(stderr, _("grubby: --default-kernel and --info may not "
 				  "be used when adding or removing kernels\n"));
 		return 1;
@@ -5397,6 +8650,17 @@ int main(int argc, const char **argv)
 		return 1;
 	}
 
+	if (retainCount != -1 && retainCount < 1) {
+		fprintf(stderr, _("grubby: --retain needs to keep at least "
+				  "one kernel\n"));
+		return 1;
+	}
+
+	/* getSelector() says what's wrong */
+	if (badSelector(removeKernelPath) || badSelector(updateKernelPath) ||
+	    badSelector(kernelInfo))
+		return 1;
+
 	if (newKernelPath && updateKernelPath) {
 		fprintf(stderr, _("grubby: --add-kernel and --update-kernel may"
 				  "not be used together"));
@@ -5423,7 +8687,8 @@ int main(int argc, const char **argv)
 		return 1;
 	}
 
-	if (grubConfig && !strcmp(grubConfig, "-") && !outputFile) {
+	if (grubConfig && !strcmp(grubConfig, "-") && !outputFile &&
+	    !diffOutput) {
 		fprintf(stderr,
 			_("grubby: output file must be specified if stdin "
 			  "is used\n"));
@@ -5433,7 +8698,8 @@ int main(int argc, const char **argv)
 	if (!removeKernelPath && !newKernelPath && !displayDefault
 	    && !defaultKernel && !kernelInfo && !bootloaderProbe
 	    && !updateKernelPath && !removeMBKernel && !displayDefaultIndex
-	    && !displayDefaultTitle && (defaultIndex == -1)) {
+	    && !displayDefaultTitle && (defaultIndex == -1)
+	    && !sortByVersion && !removeStale && retainCount == -1) {
 		fprintf(stderr, _("grubby: no action specified\n"));
 		return 1;
 	}
@@ -5546,6 +8812,19 @@ int main(int argc, const char **argv)
 		exit(1);
 	}
 
+	/* the display options only look at the default entry */
+	lazyParse = displayDefault || displayDefaultIndex ||
+	    displayDefaultTitle;
+
+	if (diffOutput && cfi->entryPerFile) {
+		fprintf(stderr,
+			_("grubby: --diff can't be used with --bls\n"));
+		return 1;
+	}
+
+	if (kernelInfo && !strcmp(kernelInfo, "ALL") && !cfi->entryPerFile)
+		return streamInfo(grubConfig, cfi, bootPrefix);
+
 	config = readConfig(grubConfig, cfi);
 	if (!config)
 		return 1;
@@ -5568,8 +8847,8 @@ int main(int argc, const char **argv)
 		suitableImage(entry, bootPrefix, 0, flags);
 
 		line =
-		    getLineByType(LT_KERNEL | LT_HYPER | LT_KERNEL_EFI |
-				  LT_KERNEL_16, entry->lines);
+		    getEntryLineByType(LT_KERNEL | LT_HYPER | LT_KERNEL_EFI |
+				  LT_KERNEL_16, entry);
 		if (!line)
 			return 0;
 
@@ -5593,7 +8872,7 @@ int main(int argc, const char **argv)
 
 		if (!configureGrub2) {
 			char *title;
-			line = getLineByType(LT_TITLE, entry->lines);
+			line = getEntryLineByType(LT_TITLE, entry);
 			if (!line)
 				return 0;
 			title = extractTitle(config, line);
@@ -5606,7 +8885,7 @@ int main(int argc, const char **argv)
 
 			dbgPrintf
 			    ("This is GRUB2, default title is embeded in menuentry\n");
-			line = getLineByType(LT_MENUENTRY, entry->lines);
+			line = getEntryLineByType(LT_MENUENTRY, entry);
 			if (!line)
 				return 0;
 			title = grub2ExtractTitle(line);
@@ -5635,6 +8914,13 @@ int main(int argc, const char **argv)
 
 	markRemovedImage(config, removeKernelPath, bootPrefix);
 	markRemovedImage(config, removeMBKernel, bootPrefix);
+	/* a wrong --boot-filesystem makes everything look stale */
+	if (removeStale && !markStaleImages(config, bootPrefix)) {
+		fprintf(stderr, _("grubby: none of the kernels were found in "
+				  "%s, not removing any entries\n"),
+			*bootPrefix ? bootPrefix : "/");
+		return 1;
+	}
 	setDefaultImage(config, newKernelPath != NULL, defaultKernel,
 			makeDefault, bootPrefix, flags, defaultIndex,
 			newIndex);
@@ -5661,6 +8947,12 @@ int main(int argc, const char **argv)
 			 newIndex))
 		return 1;
 
+	if (retainCount > 0 && retainKernels(config, retainCount))
+		return 1;
+
+	if (sortByVersion && sortEntries(config))
+		return 1;
+
 	if (numEntries(config) == 0) {
 		fprintf(stderr,
 			_("grubby: doing this would leave no kernel entries. "
@@ -5671,5 +8963,11 @@ int main(int argc, const char **argv)
 	if (!outputFile)
 		outputFile = (char *)grubConfig;
 
+	if (diffOutput)
+		return writeDiff(config, grubConfig, outputFile);
+
+	if (cfi->entryPerFile)
+		return writeBlsConfig(config, grubConfig, outputFile);
+
 	return writeConfig(config, outputFile, bootPrefix);
 }
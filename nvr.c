@@ -0,0 +1,260 @@
+/*
+ * nvr.c - name-version-release comparison shared by grubby and rpm-sort
+ *
+ * Copyright 2013 Red Hat, Inc.
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef USE_LIBRPM
+#include <rpm/rpmlib.h>
+#endif
+
+#include "nvr.h"
+
+static inline int
+is_digit (char c)
+{
+  return c >= '0' && c <= '9';
+}
+
+static inline int
+is_alpha (char c)
+{
+  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+}
+
+/*
+ * A copy of rpm's rpmvercmp(), returning the same result for every pair of
+ * strings, so that rpm-sort and grubby don't have to load librpmio just
+ * for this. The strings are split into runs of digits and runs of letters,
+ * everything else separating them:
+ *  - '~' sorts before anything, even the end of the string
+ *  - '^' sorts after the end of the string but before anything else
+ *  - numbers compare numerically and are newer than letters
+ *  - letters compare like strcmp()
+ *  - if all the runs compare equal, the longer string is newer
+ * Unlike rpmvercmp(), the runs are compared in place without copying.
+ */
+int
+nvr_vercmp (const char *a, const char *b)
+{
+  const char *one = a, *two = b;
+  const char *end1, *end2;
+  size_t len1, len2;
+  int isnum;
+  int rc;
+
+  /* easy comparison to see if versions are identical */
+  if (!strcmp (a, b))
+    return 0;
+
+  while (*one || *two)
+    {
+      while (*one && !is_digit (*one) && !is_alpha (*one)
+             && *one != '~' && *one != '^')
+        one++;
+      while (*two && !is_digit (*two) && !is_alpha (*two)
+             && *two != '~' && *two != '^')
+        two++;
+
+      /* handle the tilde separator, it sorts before everything else */
+      if (*one == '~' || *two == '~')
+        {
+          if (*one != '~')
+            return 1;
+          if (*two != '~')
+            return -1;
+          one++;
+          two++;
+          continue;
+        }
+
+      /* the caret is like the tilde, except that if one of the strings
+       * ends (base version), the other is considered a higher version */
+      if (*one == '^' || *two == '^')
+        {
+          if (!*one)
+            return -1;
+          if (!*two)
+            return 1;
+          if (*one != '^')
+            return 1;
+          if (*two != '^')
+            return -1;
+          one++;
+          two++;
+          continue;
+        }
+
+      /* if we ran to the end of either, we are finished with the loop */
+      if (!(*one && *two))
+        break;
+
+      /* grab the first completely alpha or completely numeric segment */
+      end1 = one;
+      end2 = two;
+      if (is_digit (*one))
+        {
+          while (is_digit (*end1))
+            end1++;
+          while (is_digit (*end2))
+            end2++;
+          isnum = 1;
+        }
+      else
+        {
+          while (is_alpha (*end1))
+            end1++;
+          while (is_alpha (*end2))
+            end2++;
+          isnum = 0;
+        }
+
+      /* the segments are of different types: numeric segments are
+       * always newer than alpha segments */
+      if (two == end2)
+        return isnum ? 1 : -1;
+
+      if (isnum)
+        {
+          /* throw away any leading zeros, then whichever number has more
+           * digits wins */
+          while (*one == '0' && one < end1)
+            one++;
+          while (*two == '0' && two < end2)
+            two++;
+        }
+
+      len1 = end1 - one;
+      len2 = end2 - two;
+      if (isnum && len1 != len2)
+        return len1 > len2 ? 1 : -1;
+
+      rc = memcmp (one, two, len1 < len2 ? len1 : len2);
+      if (rc)
+        return rc < 0 ? -1 : 1;
+      if (len1 != len2)
+        return len1 > len2 ? 1 : -1;
+
+      one = end1;
+      two = end2;
+    }
+
+  /* all the segments compared equal but the separators were different */
+  if (!*one && !*two)
+    return 0;
+
+  /* whichever version still has characters left over wins */
+  return *one ? 1 : -1;
+}
+
+/* the comparison rpm uses, from librpmio when built WITH_LIBRPM */
+int
+nvr_rpmvercmp (const char *a, const char *b)
+{
+#ifdef USE_LIBRPM
+  return rpmvercmp (a, b);
+#else
+  return nvr_vercmp (a, b);
+#endif
+}
+
+/* returns name/version/release */
+/* NULL string pointer returned if nothing found */
+void
+nvr_split (char *package_string, char **name, char **version, char **release)
+{
+  char *package_version, *package_release;
+
+  /* Release */
+  package_release = strrchr (package_string, '-');
+
+  if (package_release != NULL)
+      *package_release++ = '\0';
+
+  *release = package_release;
+
+  /* Version */
+  package_version = strrchr(package_string, '-');
+
+  if (package_version != NULL)
+      *package_version++ = '\0';
+
+  *version = package_version;
+  /* Name */
+  *name = package_string;
+
+  /* Bubble up non-null values from release to name */
+  if (*name == NULL)
+    {
+      *name = (*version == NULL ? *release : *version);
+      *version = *release;
+      *release = NULL;
+    }
+  if (*version == NULL)
+    {
+      *version = *release;
+      *release = NULL;
+    }
+}
+
+int
+nvr_init (struct nvr *nvr, const char *package_string)
+{
+  nvr->buf = strdup (package_string);
+  if (!nvr->buf)
+    return -1;
+
+  nvr_split (nvr->buf, &nvr->name, &nvr->version, &nvr->release);
+  return 0;
+}
+
+void
+nvr_fini (struct nvr *nvr)
+{
+  free (nvr->buf);
+  memset (nvr, 0, sizeof (*nvr));
+}
+
+/* compares name, then version, then release */
+int
+nvr_compare (const struct nvr *lhs, const struct nvr *rhs, nvr_cmp_fn cmp)
+{
+  int vercmpflag;
+
+  /* Check Name and return if unequal */
+  vercmpflag = cmp ((lhs->name == NULL ? "" : lhs->name),
+                    (rhs->name == NULL ? "" : rhs->name));
+  if (vercmpflag != 0)
+    return vercmpflag;
+
+  /* Check version and return if unequal */
+  vercmpflag = cmp ((lhs->version == NULL ? "" : lhs->version),
+                    (rhs->version == NULL ? "" : rhs->version));
+  if (vercmpflag != 0)
+    return vercmpflag;
+
+  /* Check release and return the version compare value */
+  return cmp ((lhs->release == NULL ? "" : lhs->release),
+              (rhs->release == NULL ? "" : rhs->release));
+}
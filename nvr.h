@@ -0,0 +1,43 @@
+/*
+ * nvr.h
+ *
+ * Copyright 2013 Red Hat, Inc.
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef GRUBBY_NVR_H
+#define GRUBBY_NVR_H 1
+
+typedef int (*nvr_cmp_fn)(const char *s1, const char *s2);
+
+/* a name-version-release string split into its parts; the parts point
+ * into buf and are NULL when missing */
+struct nvr {
+	char *buf;
+	char *name;
+	char *version;
+	char *release;
+};
+
+extern int nvr_vercmp(const char *a, const char *b);
+extern int nvr_rpmvercmp(const char *a, const char *b);
+extern void nvr_split(char *package_string, char **name, char **version,
+		      char **release);
+extern int nvr_init(struct nvr *nvr, const char *package_string);
+extern void nvr_fini(struct nvr *nvr);
+extern int nvr_compare(const struct nvr *lhs, const struct nvr *rhs,
+		       nvr_cmp_fn cmp);
+
+#endif /* GRUBBY_NVR_H */
@@ -2,12 +2,19 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 #include <errno.h>
 #include <assert.h>
 #include <argp.h>
-#include <rpm/rpmlib.h>
+#include <pthread.h>
 #include <err.h>
+#include <search.h>
+
+#include "nvr.h"
 
 typedef enum {
         RPMNVRCMP,
@@ -42,31 +49,49 @@ static inline char *xstrdup(const char * const s)
         return ret;
 }
 
+/* Reads the whole input into one buffer. Regular files are read with a
+ * single read() of their size; pipes grow the buffer geometrically. */
 static size_t
 read_file (const char *input, char **ret)
 {
-  FILE *in;
-  size_t s;
-  size_t sz = 2048;
+  struct stat sb;
+  size_t expected = SIZE_MAX;
+  size_t sz = 65536;
   size_t offset = 0;
+  ssize_t s;
   char *text;
+  int fd;
 
   if (!strcmp(input, "-"))
-    in = stdin;
+    fd = STDIN_FILENO;
   else
-    in = fopen(input, "r");
-
-  text = xmalloc (sz);
+    fd = open(input, O_RDONLY);
 
-  if (!in)
+  if (fd < 0)
     err(1, "cannot open `%s'", input);
 
-  while ((s = fread (text + offset, 1, sz - offset, in)) != 0)
+  if (!fstat (fd, &sb) && S_ISREG (sb.st_mode))
     {
+      expected = sb.st_size;
+      sz = expected + 1;
+    }
+
+  text = xmalloc (sz);
+
+  while (offset < expected
+	 && (s = read (fd, text + offset, sz - offset - 1)) != 0)
+    {
+      if (s < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  err(1, "cannot read `%s'", input);
+	}
+
       offset += s;
-      if (sz - offset == 0)
+      if (sz - offset == 1 && offset < expected)
 	{
-	  sz += 2048;
+	  sz *= 2;
 	  text = xrealloc (text, sz);
 	}
     }
@@ -74,180 +99,404 @@ read_file (const char *input, char **ret)
   text[offset] = '\0';
   *ret = text;
 
-  if (in != stdin)
-    fclose(in);
+  if (fd != STDIN_FILENO)
+    close(fd);
 
   return offset + 1;
 }
 
-/* returns name/version/release */
-/* NULL string pointer returned if nothing found */
+/* an input line, split into name/version/release once up front so that
+ * the comparisons done by qsort don't have to copy and split it again */
+struct package
+{
+  char *string;
+  struct nvr nvr;
+  size_t pos;			/* input order, so equal names stay in it */
+};
+
+static nvr_cmp_fn cmp;
+static int split;
+static unsigned long jobs = 1;
+static size_t latest;
+static int unique;
+static int reverse;
+
 static void
-split_package_string (char *package_string, char **name,
-                     char **version, char **release)
+select_comparitor (void)
+{
+  switch(comparitor)
+    {
+    default: /* just to shut up -Werror=maybe-uninitialized */
+    case RPMNVRCMP:
+      cmp = nvr_rpmvercmp;
+      split = 1;
+      break;
+    case VERSNVRCMP:
+      cmp = strverscmp;
+      split = 1;
+      break;
+    case RPMVERCMP:
+      cmp = nvr_rpmvercmp;
+      break;
+    case STRVERSCMP:
+      cmp = strverscmp;
+      break;
+    }
+}
+
+static void
+split_package (struct package *package)
+{
+  if (split && nvr_init (&package->nvr, package->string) < 0)
+    err(1, "cannot split `%s'", package->string);
+}
+
+static void
+free_package (struct package *package)
+{
+  if (split)
+    nvr_fini (&package->nvr);
+}
+
+/* compares by name-version-release or by the whole string */
+static int
+package_key_compare (const struct package *lhs, const struct package *rhs)
 {
-  char *package_version, *package_release;
+  if (split)
+    return nvr_compare (&lhs->nvr, &rhs->nvr, cmp);
 
-  /* Release */
-  package_release = strrchr (package_string, '-');
+  return cmp (lhs->string, rhs->string);
+}
 
-  if (package_release != NULL)
-      *package_release++ = '\0';
+/*
+ * package comparator for qsort
+ * expects p, q which are pointers to struct package
+ */
+static int
+package_compare (const void *p, const void *q)
+{
+  const struct package *lhs = p, *rhs = q;
+  int vercmpflag;
 
-  *release = package_release;
+  vercmpflag = package_key_compare (lhs, rhs);
+  if (vercmpflag != 0)
+    return vercmpflag;
 
-  /* Version */
-  package_version = strrchr(package_string, '-');
+  return lhs->pos < rhs->pos ? -1 : lhs->pos > rhs->pos;
+}
 
-  if (package_version != NULL)
-      *package_version++ = '\0';
+struct sort_job
+{
+  pthread_t thread;
+  struct package *src;
+  struct package *dst;
+  size_t lo, mid, hi;
+};
 
-  *version = package_version;
-  /* Name */
-  *name = package_string;
+static void *
+sort_chunk (void *arg)
+{
+  struct sort_job *job = arg;
+  size_t i;
 
-  /* Bubble up non-null values from release to name */
-  if (*name == NULL)
+  for (i = job->lo; i < job->hi; i++)
+    split_package (&job->src[i]);
+
+  qsort (job->src + job->lo, job->hi - job->lo, sizeof (*job->src),
+	 package_compare);
+  return NULL;
+}
+
+/* merges the sorted runs src[lo..mid) and src[mid..hi) into dst[lo..hi) */
+static void *
+merge_chunks (void *arg)
+{
+  struct sort_job *job = arg;
+  size_t i = job->lo, j = job->mid, k = job->lo;
+
+  while (i < job->mid && j < job->hi)
     {
-      *name = (*version == NULL ? *release : *version);
-      *version = *release;
-      *release = NULL;
+      if (package_compare (&job->src[j], &job->src[i]) < 0)
+	job->dst[k++] = job->src[j++];
+      else
+	job->dst[k++] = job->src[i++];
     }
-  if (*version == NULL)
+  while (i < job->mid)
+    job->dst[k++] = job->src[i++];
+  while (j < job->hi)
+    job->dst[k++] = job->src[j++];
+
+  return NULL;
+}
+
+/* runs fn on every job, each on its own thread when there's more than one */
+static void
+run_jobs (void *(*fn)(void *), struct sort_job *sort_jobs, size_t n_jobs)
+{
+  size_t i;
+
+  if (n_jobs == 1)
     {
-      *version = *release;
-      *release = NULL;
+      fn (&sort_jobs[0]);
+      return;
     }
+
+  for (i = 0; i < n_jobs; i++)
+    if (pthread_create (&sort_jobs[i].thread, NULL, fn, &sort_jobs[i]) != 0)
+      errx(1, "cannot create thread");
+
+  for (i = 0; i < n_jobs; i++)
+    pthread_join (sort_jobs[i].thread, NULL);
 }
 
-static int
-cmprpmversp(const void *p1, const void *p2)
+/*
+ * Sorts the packages, returning the sorted array. With --jobs, they are
+ * cut into one chunk per thread, the chunks are sorted in parallel and
+ * then merged pairwise. Ties are broken by input position, so the result
+ * doesn't depend on the number of jobs.
+ */
+static struct package *
+sort_packages (struct package *packages, size_t n_packages)
+{
+  struct package *tmp, *swap;
+  struct sort_job *sort_jobs;
+  size_t *bounds;
+  size_t n_chunks, i;
+
+  n_chunks = jobs;
+  if (n_chunks > n_packages)
+    n_chunks = n_packages;
+
+  sort_jobs = xmalloc (sizeof (*sort_jobs) * n_chunks);
+  bounds = xmalloc (sizeof (*bounds) * (n_chunks + 1));
+  for (i = 0; i <= n_chunks; i++)
+    bounds[i] = n_packages * i / n_chunks;
+
+  for (i = 0; i < n_chunks; i++)
+    {
+      sort_jobs[i].src = packages;
+      sort_jobs[i].lo = bounds[i];
+      sort_jobs[i].hi = bounds[i + 1];
+    }
+  run_jobs (sort_chunk, sort_jobs, n_chunks);
+
+  tmp = n_chunks > 1 ? xmalloc (sizeof (*tmp) * n_packages) : NULL;
+  while (n_chunks > 1)
+    {
+      size_t n_merges = n_chunks / 2;
+
+      for (i = 0; i < n_merges; i++)
+	{
+	  sort_jobs[i].src = packages;
+	  sort_jobs[i].dst = tmp;
+	  sort_jobs[i].lo = bounds[2 * i];
+	  sort_jobs[i].mid = bounds[2 * i + 1];
+	  sort_jobs[i].hi = bounds[2 * i + 2];
+	}
+      run_jobs (merge_chunks, sort_jobs, n_merges);
+
+      /* an odd chunk out is carried over as it is */
+      if (n_chunks % 2)
+	memcpy (tmp + bounds[n_chunks - 1], packages + bounds[n_chunks - 1],
+		sizeof (*tmp) * (bounds[n_chunks] - bounds[n_chunks - 1]));
+
+      for (i = 0; i <= n_merges; i++)
+	bounds[i] = bounds[2 * i < n_chunks ? 2 * i : n_chunks];
+      bounds[(n_chunks + 1) / 2] = n_packages;
+      n_chunks = (n_chunks + 1) / 2;
+
+      swap = packages;
+      packages = tmp;
+      tmp = swap;
+    }
+  free (tmp);
+  free (bounds);
+  free (sort_jobs);
+
+  return packages;
+}
+
+/* drops the packages which compare equal to the one before them; the
+ * first of each run is the one which came first in the input */
+static size_t
+unique_packages (struct package *packages, size_t n_packages)
 {
-        return rpmvercmp(*(char * const *)p1, *(char * const *)p2);
+  size_t i, n = 0;
+
+  for (i = 0; i < n_packages; i++)
+    {
+      if (n > 0 && package_key_compare (&packages[n - 1], &packages[i]) == 0)
+	{
+	  free_package (&packages[i]);
+	  continue;
+	}
+      packages[n++] = packages[i];
+    }
+
+  return n;
+}
+
+static void
+heap_sift_down (struct package **heap, size_t n, size_t i)
+{
+  struct package *tmp;
+  size_t child;
+
+  while ((child = 2 * i + 1) < n)
+    {
+      if (child + 1 < n && package_compare (heap[child + 1], heap[child]) < 0)
+	child++;
+      if (package_compare (heap[child], heap[i]) >= 0)
+	break;
+      tmp = heap[i];
+      heap[i] = heap[child];
+      heap[child] = tmp;
+      i = child;
+    }
 }
 
+static void
+heap_sift_up (struct package **heap, size_t i)
+{
+  struct package *tmp;
+
+  while (i > 0 && package_compare (heap[i], heap[(i - 1) / 2]) < 0)
+    {
+      tmp = heap[i];
+      heap[i] = heap[(i - 1) / 2];
+      heap[(i - 1) / 2] = tmp;
+      i = (i - 1) / 2;
+    }
+}
+
+/* package_key_compare() for tsearch() and friends */
 static int
-cmpstrversp(const void *p1, const void *p2)
+package_key_compare_tree (const void *p, const void *q)
+{
+  return package_key_compare (p, q);
+}
+
+static void
+package_tree_free_node (void *nodep)
 {
-        return strverscmp(*(char * const *)p1, *(char * const *)p2);
 }
 
 /*
- * package name-version-release comparator for qsort
- * expects p, q which are pointers to character strings (char *)
- * which will not be altered in this function
+ * Keeps only the k newest packages, sorted, at the start of the array,
+ * and returns how many there are. The oldest of the ones kept so far sits
+ * at the top of a min-heap, so each package costs at most log k
+ * comparisons instead of sorting all of them. With --unique, a package
+ * equal to one already kept is dropped: the kept one came first. The kept
+ * keys are also in a search tree, so that costs log k comparisons too.
+ * The heap and the tree point into the array, which is only rearranged
+ * at the end.
  */
-static int
-package_version_compare (const void *p, const void *q)
+static size_t
+latest_packages (struct package *packages, size_t n_packages, size_t k)
 {
-  char *local_p, *local_q;
-  char *lhs_name, *lhs_version, *lhs_release;
-  char *rhs_name, *rhs_version, *rhs_release;
-  int vercmpflag = 0;
-  int (*cmp)(const char *s1, const char *s2);
+  struct package **heap, *kept;
+  void *tree = NULL;
+  size_t i, n = 0;
 
-  switch(comparitor)
-    {
-    default: /* just to shut up -Werror=maybe-uninitialized */
-    case RPMNVRCMP:
-      cmp = rpmvercmp;
-      break;
-    case VERSNVRCMP:
-      cmp = strverscmp;
-      break;
-    case RPMVERCMP:
-      return cmprpmversp(p, q);
-      break;
-    case STRVERSCMP:
-      return cmpstrversp(p, q);
-      break;
-    }
+  heap = xmalloc (sizeof (*heap) * k);
 
-  local_p = alloca (strlen (*(char * const *)p) + 1);
-  local_q = alloca (strlen (*(char * const *)q) + 1);
+  for (i = 0; i < n_packages; i++)
+    {
+      struct package *package = &packages[i];
 
-  /* make sure these allocated */
-  assert (local_p);
-  assert (local_q);
+      split_package (package);
 
-  strcpy (local_p, *(char * const *)p);
-  strcpy (local_q, *(char * const *)q);
+      if ((n == k && package_compare (package, heap[0]) <= 0) ||
+	  (unique && tfind (package, &tree, package_key_compare_tree)))
+	{
+	  free_package (package);
+	  continue;
+	}
 
-  split_package_string (local_p, &lhs_name, &lhs_version, &lhs_release);
-  split_package_string (local_q, &rhs_name, &rhs_version, &rhs_release);
+      if (n < k)
+	{
+	  heap[n] = package;
+	  heap_sift_up (heap, n++);
+	}
+      else
+	{
+	  if (unique)
+	    tdelete (heap[0], &tree, package_key_compare_tree);
+	  free_package (heap[0]);
+	  heap[0] = package;
+	  heap_sift_down (heap, n, 0);
+	}
 
-  /* Check Name and return if unequal */
-  vercmpflag = cmp ((lhs_name == NULL ? "" : lhs_name),
-                    (rhs_name == NULL ? "" : rhs_name));
-  if (vercmpflag != 0)
-    return vercmpflag;
+      if (unique)
+	tsearch (package, &tree, package_key_compare_tree);
+    }
 
-  /* Check version and return if unequal */
-  vercmpflag = cmp ((lhs_version == NULL ? "" : lhs_version),
-                    (rhs_version == NULL ? "" : rhs_version));
-  if (vercmpflag != 0)
-    return vercmpflag;
+  tdestroy (tree, package_tree_free_node);
 
-  /* Check release and return the version compare value */
-  vercmpflag = cmp ((lhs_release == NULL ? "" : lhs_release),
-                    (rhs_release == NULL ? "" : rhs_release));
+  kept = xmalloc (sizeof (*kept) * n);
+  for (i = 0; i < n; i++)
+    kept[i] = *heap[i];
+  memcpy (packages, kept, sizeof (*kept) * n);
+  free (kept);
+  free (heap);
 
-  return vercmpflag;
+  qsort (packages, n, sizeof (*packages), package_compare);
+  return n;
 }
 
+/* all the input lines; the names point into the input buffers */
+struct input
+{
+  char **names;
+  size_t n_names;
+  size_t names_max;
+  char **buffers;
+  size_t n_buffers;
+};
+
 static void
-add_input (const char *filename, char ***package_names, size_t *n_package_names)
+add_input (const char *filename, struct input *input)
 {
-  char *orig_input_buffer = NULL;
   char *input_buffer;
+  char *end;
   char *position_of_newline;
-  char **names = *package_names;
-  char **new_names = NULL;
-  size_t n_names = *n_package_names;
+  size_t len;
 
-  if (!*package_names)
-    new_names = names = xmalloc (sizeof (char *) * 2);
+  len = read_file (filename, &input_buffer) - 1;
 
-  if (read_file (filename, &orig_input_buffer) < 2)
+  /* like the string functions, stop at an embedded NUL */
+  end = memchr (input_buffer, '\0', len + 1);
+  if (end == input_buffer)
     {
-      if (new_names)
-	free (new_names);
-      if (orig_input_buffer)
-	free (orig_input_buffer);
+      free (input_buffer);
       return;
     }
 
-  input_buffer = orig_input_buffer;
-  while (input_buffer && *input_buffer &&
-	 (position_of_newline = strchrnul (input_buffer, '\n')))
+  input->buffers = xrealloc (input->buffers, sizeof (char *)
+			     * (input->n_buffers + 1));
+  input->buffers[input->n_buffers++] = input_buffer;
+
+  while (input_buffer < end)
     {
-      size_t sz = position_of_newline - input_buffer;
-      char *new;
+      position_of_newline = memchr (input_buffer, '\n', end - input_buffer);
+      if (!position_of_newline)
+	position_of_newline = end;
+      *position_of_newline = '\0';
 
-      if (sz == 0)
+      if (position_of_newline != input_buffer)
 	{
-	  input_buffer = position_of_newline + 1;
-	  continue;
+	  if (input->n_names == input->names_max)
+	    {
+	      input->names_max = input->names_max ? input->names_max * 2 : 64;
+	      input->names = xrealloc (input->names, sizeof (char *)
+				       * input->names_max);
+	    }
+	  input->names[input->n_names++] = input_buffer;
 	}
 
-      new = xmalloc (sz+1);
-      strncpy (new, input_buffer, sz);
-      new[sz] = '\0';
-
-      names = xrealloc (names, sizeof (char *) * (n_names + 1));
-      names[n_names] = new;
-      n_names++;
-
       /* move buffer ahead to next line */
       input_buffer = position_of_newline + 1;
-      if (*position_of_newline == '\0')
-	input_buffer = NULL;
     }
-
-  free (orig_input_buffer);
-
-  *package_names = names;
-  *n_package_names = n_names;
 }
 
 static char *
@@ -258,6 +507,10 @@ help_filter (int key, const char *text, void *input __attribute__ ((unused)))
 
 static struct argp_option options[] = {
   { "comparitor", 'c', "COMPARITOR", 0, "[rpm-nvr-cmp|vers-nvr-cmp|rpmvercmp|strverscmp]", 0},
+  { "jobs", 'j', "N", 0, "sort using N threads", 0},
+  { "latest", 'l', "K", 0, "only print the K newest strings", 0},
+  { "unique", 'u', 0, 0, "only print the first of strings which compare equal", 0},
+  { "reverse", 'r', 0, 0, "print the newest strings first", 0},
   { 0, }
 };
 
@@ -286,6 +539,32 @@ argp_parser (int key, char *arg, struct argp_state *state)
       else
         err(1, "Invalid comparitor \"%s\"", arg);
       break;
+    case 'j':
+      {
+        char *end;
+
+        errno = 0;
+        jobs = strtoul (arg, &end, 10);
+        if (errno || *end || !*arg || jobs < 1)
+          errx(1, "Invalid number of jobs \"%s\"", arg);
+      }
+      break;
+    case 'l':
+      {
+        char *end;
+
+        errno = 0;
+        latest = strtoul (arg, &end, 10);
+        if (errno || *end || !*arg || latest < 1)
+          errx(1, "Invalid number of strings \"%s\"", arg);
+      }
+      break;
+    case 'u':
+      unique = 1;
+      break;
+    case 'r':
+      reverse = 1;
+      break;
     case ARGP_KEY_ARG:
       assert (arguments->ninputs < arguments->input_max);
       arguments->inputs[arguments->ninputs++] = xstrdup (arg);
@@ -306,8 +585,9 @@ int
 main (int argc, char *argv[])
 {
   struct arguments arguments;
-  char **package_names = NULL;
-  size_t n_package_names = 0;
+  struct input input;
+  struct package *packages;
+  size_t n_packages;
   int i;
 
   memset (&arguments, 0, sizeof (struct arguments));
@@ -329,23 +609,46 @@ main (int argc, char *argv[])
       strcpy(arguments.inputs[0], "-");
     }
 
+  memset (&input, 0, sizeof (input));
   for (i = 0; i < arguments.ninputs; i++)
-    add_input(arguments.inputs[i], &package_names, &n_package_names);
+    add_input(arguments.inputs[i], &input);
 
-  if (package_names == NULL || n_package_names < 1)
+  if (input.names == NULL || input.n_names < 1)
     errx(1, "Invalid input");
 
-  qsort (package_names, n_package_names, sizeof (char *),
-	 package_version_compare);
+  select_comparitor ();
+
+  packages = xmalloc (sizeof (*packages) * input.n_names);
+  for (i = 0; i < input.n_names; i++)
+    {
+      packages[i].string = input.names[i];
+      packages[i].pos = i;
+    }
+  n_packages = input.n_names;
+
+  if (latest > 0 && latest < n_packages)
+    n_packages = latest_packages (packages, n_packages, latest);
+  else
+    {
+      packages = sort_packages (packages, n_packages);
+      if (unique)
+	n_packages = unique_packages (packages, n_packages);
+    }
 
   /* send sorted list to stdout */
-  for (i = 0; i < n_package_names; i++)
+  for (i = 0; i < n_packages; i++)
     {
-      fprintf (stdout, "%s\n", package_names[i]);
-      free (package_names[i]);
+      struct package *package = &packages[reverse ? n_packages - 1 - i : i];
+
+      fprintf (stdout, "%s\n", package->string);
+      free_package (package);
     }
+  free (packages);
 
-  free (package_names);
+  free (input.names);
+  for (i = 0; i < input.n_buffers; i++)
+    free (input.buffers[i]);
+  free (input.buffers);
   for (i = 0; i < arguments.ninputs; i++)
     free (arguments.inputs[i]);
 
@@ -49,7 +49,7 @@ oneTest() {
     shift 3
 
     local ENV_FILE=""
-    if [ "$mode" == "--grub2" ]; then
+    if [ "$mode" == "--grub2" -o "$mode" == "--bls" ]; then
         ENV_FILE="test/grub2-support_files/env_temp"
         if [ "$1" == "--env" ]; then
             cp "test/grub2-support_files/$2" "$ENV_FILE"
@@ -89,7 +89,7 @@ oneDisplayTest() {
     shift 3
 
     local ENV_FILE=""
-    if [ "$mode" == "--grub2" ]; then
+    if [ "$mode" == "--grub2" -o "$mode" == "--bls" ]; then
         ENV_FILE="test/grub2-support_files/env_temp"
         if [ "$1" == "--env" ]; then
             cp "test/grub2-support_files/$2" "$ENV_FILE"
@@ -156,6 +156,53 @@ commandTest() {
     fi
 }
 
+# Sort test/rpm-sort/$2 with rpm-sort, checking the output
+rpmSortTest() {
+    typeset correct=test/results/rpm-sort/$1 input=test/rpm-sort/$2
+    shift 2
+
+    [[ rpm-sort == $opt_bootloader ]] || return
+
+    echo "$testing ... $input $correct"
+    runme=( ./rpm-sort "$@" "$input" )
+    if "${runme[@]}" | cmp "$correct" > /dev/null; then
+	(( pass++ ))
+    else
+	(( fail++ ))
+	echo -------------------------------------------------------------
+	echo -n "FAIL: "
+	printf "%q " "${runme[@]}"; echo
+	"${runme[@]}" | diff -U30 "$correct" -
+	echo
+    fi
+}
+
+# Build a grub2 config big enough to be parsed on a thread per CPU by
+# default, and check that updating it gives the same output as a sequential
+# parse, both with the default and with an explicit number of threads
+bigConfigTest() {
+    typeset big=$(mktemp) seq=$(mktemp) par=$(mktemp) jobs
+    cat test/grub2.1 > $big
+    for i in $(seq 1200); do
+        sed -n '/^menuentry/,/^}/p' test/grub2.1
+    done >> $big
+    for jobs in 1 0 4; do
+        cp test/grub2-support_files/grubenv.0 \
+            test/grub2-support_files/env_temp
+        ./grubby --grub2 --bad-image-okay \
+            --env=test/grub2-support_files/env_temp -c $big -o - \
+            --update-kernel=ALL --args=foo --parse-jobs=$jobs > $par
+        [ $jobs == 1 ] && cp $par $seq
+        if ! cmp -s $seq $par; then
+            echo different
+            rm -f $big $seq $par
+            return
+        fi
+    done
+    echo same
+    rm -f $big $seq $par
+}
+
 # generate convenience functions
 for b in $(./grubby --help | \
 	sed -n 's/^.*--\([^ ]*\) *configure \1 bootloader.*/\1/p'); do
@@ -227,6 +274,22 @@ for n in test/*.[0-9]*; do
     rm -f ${b}-test
 done
 
+testing="New file permissions"
+if [[ grub == $opt_bootloader ]]; then
+    echo "$testing ... --grub"
+    rm -f grub-test
+    ( umask 022; ./grubby --grub --bad-image-okay -c test/grub.1 \
+	-o grub-test --remove-kernel 1234 )
+    perm=$(ls -l grub-test | awk '{print $1}')
+    if [[ $perm != -rw-r--r--* ]]; then
+	echo "  FAIL ($perm)"
+	(( fail++ ))
+    else
+	(( pass++ ))
+    fi
+    rm -f grub-test
+fi
+
 testing="Following symlinks"
 unset b
 for n in test/*.[0-9]*; do
@@ -269,6 +332,17 @@ grubTest grub.13 setdefaultindex/g.13.0 --set-default-index=0
 grubTest grub.13 setdefaultindex/g.13.1 --set-default-index=1
 grubTest grub.13 setdefaultindex/g.13.9 --set-default-index=9
 
+testing="GRUB diff output"
+grubTest grub.1 diff/g1.1 --diff --add-kernel=/boot/new-kernel.img \
+    --title=title --initrd=/boot/new-initrd --boot-filesystem=/
+grubTest grub.3 diff/g3.1 --diff --update-kernel=DEFAULT \
+    --args "hdd=notide-scsi"
+
+testing="GRUB sort entries"
+grubTest grub.6 sort/g6.1 --boot-filesystem=/ --sort-entries \
+    --add-kernel=/boot/vmlinuz-2.4.7-2.7 --title "Red Hat Linux (2.4.7-2.7)" \
+    --copy-default
+
 testing="GRUB add initrd"
 grubTest grub.14 add/g1.7 --boot-filesystem=/ --update-kernel=/vmlinuz-4.0.0-0.rc4.git1.4.fc23.x86_64 --initrd /initramfs-4.0.0-0.rc4.git1.4.fc23.x86_64.img '--args= LANG=en_US.UTF-8' '--title=Fedora (4.0.0-0.rc4.git1.4.fc23.x86_64) 23 (Rawhide)'
 
@@ -449,6 +523,9 @@ extlinuxTest extlinux.4 updargs/extlinux4.4 --boot-filesystem=/    \
 extlinuxTest extlinux.4 updargs/extlinux4.5 --boot-filesystem=/    \
     --update-kernel=ALL --args "root=/dev/hda2"
 
+testing="extlinux display info with many initrds"
+extlinuxDisplayTest extlinux.7 info/extlinux7.1 --info=0
+
 testing="LILO add kernel"
 liloTest lilo.4 add/l4.1 --add-kernel=/boot/new-kernel.img --title="title" \
     --copy-default --boot-filesystem=/boot
@@ -504,6 +581,13 @@ grubTest grub.15 add/g1.9 --add-kernel=/boot/new-kernel.img --title='title' \
 grubTest grub.15 add/g1.9 --add-kernel=/boot/new-kernel.img --title='title' \
     --initrd=/boot/new-initrd --boot-filesystem=/ --set-index 5
 
+testing="GRUB parallel parse"
+grubTest grub.1 add/g1.1 --add-kernel=/boot/new-kernel.img --title='title' \
+    --initrd=/boot/new-initrd --boot-filesystem=/ --parse-jobs=4
+grubTest grub.3 updargs/g3.4 --update-kernel=ALL --remove-args="hdd" \
+    --parse-jobs=4
+grubTest grub.13 setdefaultindex/g.13.1 --set-default-index=1 --parse-jobs=4
+
 testgrub2=n
 ARCH=$(uname -m | sed s,i[3456789]86,ia32,)
 case $ARCH in
@@ -585,6 +669,18 @@ if [ "$testgrub2" == "y" ]; then
         --args="root=/dev/mapper/rhel_team--area--222-root systemd.log_level=debug systemd.log_target=kmsg" \
         --set-index=1
 
+    testing="GRUB2 update args shared through \$kernelopts"
+    grub2Test grub2.26 updargs/g2.26 --env grubenv.6 --update-kernel=ALL \
+        --args=foo=bar --remove-args=rhgb
+    commandTest "kernelopts output" \
+        "grub2-editenv test/grub2-support_files/env_temp list" \
+        "kernelopts=root=/dev/mapper/fedora-root ro quiet foo=bar"
+    grub2Test grub2.26 diff/g2.26 --env grubenv.6 --diff \
+        --update-kernel=ALL --args=foo=bar
+    commandTest "kernelopts unchanged by --diff" \
+        "grub2-editenv test/grub2-support_files/env_temp list" \
+        "kernelopts=root=/dev/mapper/fedora-root ro rhgb quiet"
+
     testing="GRUB2 add initrd"
     grub2Test grub2.2 add/g2-1.4 --update-kernel=/boot/new-kernel.img \
         --initrd=/boot/new-initrd --boot-filesystem=/boot/
@@ -604,9 +700,19 @@ if [ "$testgrub2" == "y" ]; then
     grub2DisplayTest grub2.1 debug/g2.1.2 --boot-filesystem=/boot \
         --default-kernel --debug
 
+    testing="GRUB2 display default kernel with an unresolvable root="
+    grub2DisplayTest grub2.29 defaultkernel/g2.29 --bad-image-bad \
+        --boot-filesystem=test/grub2-support_files/stale-boot --default-kernel
+
     testing="GRUB2 remove kernel via index"
     grub2Test grub2.3 remove/g2-1.1 --remove-kernel=1
 
+    testing="GRUB2 diff output"
+    grub2Test grub2.3 diff/g2-3.1 --diff --remove-kernel=1
+
+    testing="GRUB2 sort entries"
+    grub2Test grub2.3 sort/g2-3.1 --sort-entries
+
     testing="GRUB2 remove kernel via title"
     grub2Test grub2.3 remove/g2-1.1 --remove-kernel="TITLE=title2"
 
@@ -616,6 +722,13 @@ if [ "$testgrub2" == "y" ]; then
     testing="GRUB2 (submenu) remove kernel via title"
     grub2Test grub2.4 remove/g2-1.2 --remove-kernel="TITLE=title2"
 
+    testing="GRUB2 (submenu) remove kernel via menu path"
+    grub2Test grub2.4 remove/g2-1.2 --remove-kernel="1>0"
+    grub2Test grub2.27 remove/g2.27 --remove-kernel="TITLE=Advanced options for Fedora>Fedora, with Linux 2.6.38.2-9.fc15.x86_64"
+    grub2Test grub2.27 remove/g2.27 --remove-kernel="1>Fedora, with Linux 2.6.38.2-9.fc15.x86_64"
+    grub2DisplayTest grub2.27 info/g2.27.4 \
+        --info="1>Fedora, with Linux 2.6.38.2-9.fc15.x86_64"
+
     testing="GRUB2 default index directive"
     grub2Test grub2.1 setdefaultindex/g2.1.0 --set-default-index=0
     grub2Test grub2.1 setdefaultindex/g2.1.1 --set-default-index=1
@@ -661,6 +774,88 @@ if [ "$testgrub2" == "y" ]; then
     testing="GRUB2 --default-index with default=saved_entry and empty grubenv"
     grub2DisplayTest grub2.8 defaultindex/0 --env grubenv.0 --default-index
 
+    testing="GRUB2 --default-index with a submenu path in saved_entry"
+    grub2DisplayTest grub2.27 defaultindex/3 --env grubenv.7 --default-index
+
+    testing="GRUB2 set default to an entry in a submenu"
+    grub2Test grub2.27 default/g2.27 --env grubenv.0 --set-default="1>0"
+    commandTest "saved_default output" \
+        "grub2-editenv test/grub2-support_files/env_temp list" \
+        "saved_entry=Advanced options for Fedora>Fedora, with Linux 2.6.38.8-32.fc15.x86_64"
+
+    testing="GRUB2 --default-index with menuentry ids in saved_entry"
+    grub2DisplayTest grub2.27 defaultindex/3 --env grubenv.8 --default-index
+
+    testing="GRUB2 set default by menuentry id"
+    grub2Test grub2.27 default/g2.27 --env grubenv.8 \
+        --set-default=ID=gnulinux-2.6.38.2-9.fc15.x86_64-advanced-5a2ca487-30f7-4fa5-96bd-abe38b68ceb3
+    commandTest "saved_default output" \
+        "grub2-editenv test/grub2-support_files/env_temp list" \
+        "saved_entry=gnulinux-advanced-5a2ca487-30f7-4fa5-96bd-abe38b68ceb3>gnulinux-2.6.38.2-9.fc15.x86_64-advanced-5a2ca487-30f7-4fa5-96bd-abe38b68ceb3"
+
+    testing="GRUB2 add kernel which copies the default's menuentry id"
+    grub2Test grub2.27 add/g2.27.1 --env grubenv.10 \
+        --add-kernel=/boot/new-kernel.img --title=title --copy-default \
+        --set-index=0
+    commandTest "saved_entry names the default, not the copy" \
+        "grub2-editenv test/grub2-support_files/env_temp list" \
+        "saved_entry=Fedora, with Linux 2.6.38.8-32.fc15.x86_64"
+    grub2Test grub2.27 add/g2.27.2 --env grubenv.10 \
+        --add-kernel=/boot/new-kernel.img --title=title --copy-default \
+        --set-index=2
+    commandTest "saved_entry id still names the default" \
+        "grub2-editenv test/grub2-support_files/env_temp list" \
+        "saved_entry=gnulinux-simple-5a2ca487-30f7-4fa5-96bd-abe38b68ceb3"
+
+    testing="GRUB2 sort entries saved by menuentry id"
+    grub2Test grub2.30 sort/g2.30 --env grubenv.11 --sort-entries
+    commandTest "saved_entry id still names the default" \
+        "grub2-editenv test/grub2-support_files/env_temp list" \
+        "saved_entry=fedora-4.18.5-200.fc29.x86_64"
+
+    testing="GRUB2 remove kernel by menuentry id"
+    grub2Test grub2.27 remove/g2.27 \
+        --remove-kernel=ID=gnulinux-2.6.38.2-9.fc15.x86_64-advanced-5a2ca487-30f7-4fa5-96bd-abe38b68ceb3
+
+    testing="GRUB2 select entries with MATCH="
+    grub2DisplayTest grub2.27 info/g2.27 --boot-filesystem=/boot \
+        --info='MATCH=kernel=/boot/vmlinuz-2.6.38.8* && !index=0'
+    grub2Test grub2.27 remove/g2.27 \
+        --remove-kernel='MATCH=title~"2\.6\.38\.2" && arg=quiet'
+    grub2DisplayTest grub2.26 info/g2.26 --env grubenv.6 \
+        --info='MATCH=arg=quiet && arg=root=/dev/mapper/*'
+    grub2DisplayTest grub2.27 info/g2.27.2 --info='MATCH=bogus=1'
+    grub2DisplayTest grub2.27 info/g2.27.2 -o - --remove-kernel='MATCH=bogus=1'
+    grub2DisplayTest grub2.27 info/g2.27.2 -o - --args=foo \
+        --update-kernel='MATCH=bogus=1'
+
+    testing="GRUB2 display info for all entries"
+    grub2DisplayTest grub2.27 info/g2.27.3 --info=ALL
+    grub2DisplayTest grub2-support_files info/g2.read-error --info=ALL
+
+    testing="GRUB2 parallel parse"
+    grub2Test grub2.1 add/g2-1.1 --add-kernel=/boot/new-kernel.img \
+        --title='title' --initrd=/boot/new-initrd --boot-filesystem=/boot/ \
+        --copy-default --parse-jobs=4
+    grub2Test grub2.1 remove/g2-1.4 \
+        --remove-kernel=/boot/vmlinuz-2.6.38.2-9.fc15.x86_64 \
+        --boot-filesystem=/boot/ --parse-jobs=4
+    grub2DisplayTest grub2.27 info/g2.27 --boot-filesystem=/boot \
+        --info='MATCH=kernel=/boot/vmlinuz-2.6.38.8* && !index=0' \
+        --parse-jobs=4
+    grub2Test grub2.28 remove/g2.28 --env grubenv.9 --retain 1 --parse-jobs=4
+    commandTest "GRUB2 parallel parse of a big config" bigConfigTest same
+
+    testing="GRUB2 remove stale entries"
+    grub2Test grub2.27 remove/g2.27 --remove-stale \
+        --boot-filesystem=test/grub2-support_files/stale-boot
+
+    testing="GRUB2 retain the newest kernels"
+    grub2Test grub2.28 remove/g2.28 --env grubenv.9 --retain 1
+    commandTest "saved_entry after --retain" \
+        "grub2-editenv test/grub2-support_files/env_temp list" \
+        "saved_entry=Fedora (4.18.5-200.fc29.x86_64) 29 (Twenty Nine)"
+
     testlinux16=n
     case $ARCH in
         ia32|x86_64) testlinux16=y ;;
@@ -725,6 +920,37 @@ if [ "$testgrub2" == "y" ]; then
     fi
 fi
 
+testing="BLS add kernel"
+blsTest bls-support_files/entries.1 add/bls1.1 \
+    --add-kernel=/boot/vmlinuz-4.20.0-1.fc29.x86_64 --title='title' \
+    --initrd=/boot/initramfs-4.20.0-1.fc29.x86_64.img \
+    --boot-filesystem=/boot --copy-default
+blsTest bls-support_files/entries.1 add/bls1.2 \
+    --add-kernel=/boot/vmlinuz-4.20.0-1.fc29.x86_64 --title='title' \
+    --initrd=/boot/initramfs-4.20.0-1.fc29.x86_64.img \
+    --boot-filesystem=/boot --copy-default --args='foo=bar'
+
+testing="BLS remove kernel"
+blsTest bls-support_files/entries.1 remove/bls1.1 --boot-filesystem=/boot \
+    --remove-kernel=/boot/vmlinuz-4.19.2-300.fc29.x86_64
+
+testing="BLS update args shared through \$kernelopts"
+blsTest bls-support_files/entries.2 updargs/bls2.1 --env grubenv.6 \
+    --boot-filesystem=/boot --update-kernel=ALL \
+    --args="rd.lvm.lv=fedora/root" --remove-args=quiet
+commandTest "kernelopts output" \
+    "grub2-editenv test/grub2-support_files/env_temp list" \
+    "kernelopts=root=/dev/mapper/fedora-root ro rhgb rd.lvm.lv=fedora/root"
+
+testing="BLS select entries by arguments in \$kernelopts"
+blsDisplayTest bls-support_files/entries.2 info/bls2.1 --env grubenv.6 \
+    --boot-filesystem=/boot --info='MATCH=arg=quiet && index=1-'
+
+testing="BLS --default-index with saved_entry"
+blsDisplayTest bls-support_files/entries.1 defaultindex/0 --default-index
+blsDisplayTest bls-support_files/entries.1 defaultindex/1 --env grubenv.5 \
+    --default-index
+
 testing="YABOOT add kernel"
 yabootTest yaboot.1 add/y1.1 --copy-default --boot-filesystem=/ --add-kernel=/boot/new-kernel  \
     --title=newtitle
@@ -831,6 +1057,18 @@ eliloTest elilo.2 multiboot/e2.2 --boot-filesystem=/boot \
 eliloTest elilo.2 multiboot/e2.3 --boot-filesystem=/boot \
     --remove-multiboot=/boot/xen.gz
 
+testing="rpm-sort"
+rpmSortTest sorted kernels
+rpmSortTest reverse kernels --reverse
+rpmSortTest unique kernels --unique
+rpmSortTest latest kernels --latest=3
+rpmSortTest latest-unique kernels --latest=6 --unique
+
+testing="rpm-sort with threads"
+rpmSortTest sorted kernels --jobs=1
+rpmSortTest sorted kernels --jobs=4
+rpmSortTest sorted kernels --jobs=64
+
 printf "\n%d (%d%%) tests passed, %d (%d%%) tests failed\n" \
     $pass $(((100*pass)/(pass+fail))) \
     $fail $(((100*fail)/(pass+fail)))
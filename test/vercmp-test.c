@@ -0,0 +1,124 @@
+/*
+ * vercmp-test.c - check nvr_vercmp() against librpmio's rpmvercmp()
+ *
+ * Copyright 2013 Red Hat, Inc.
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <rpm/rpmlib.h>
+
+#include "../nvr.h"
+
+#define N_RANDOM 2000000
+
+static const char *fixed[] = {
+	"", "0", "00", "1", "01", "1.0", "1.00", "1.0.0", "1_0", "1-0",
+	"a", "A", "b", "aa", "1a", "a1", "1.a", "1.1a", "1.1.a", "1a1",
+	"~", "~~", "1~", "1~rc1", "1~~", "1.0~rc1", "1.0~rc1~git1", "^",
+	"^^", "1^", "1^git1", "1.0^", "1.0^1", "1.0~^", "1.0^~", "~^",
+	"99999999999999999999", "099999999999999999999",
+	"100000000000000000000", "2.6.38.8-32.fc15.x86_64",
+	"4.18.0-80.el8.x86_64", "4.18.0-80.11.2.el8_0.x86_64+debug",
+	"5.0.0-0.rc2.git1.1.fc30", "5.0.0-1.fc30", "\xe9", "1\xe9" "2",
+};
+
+/* a fixed generator, so a failure can be reproduced */
+static uint32_t rnd_state = 2463534242U;
+
+static uint32_t rnd(void)
+{
+	rnd_state ^= rnd_state << 13;
+	rnd_state ^= rnd_state >> 17;
+	rnd_state ^= rnd_state << 5;
+	return rnd_state;
+}
+
+static void random_version(char *buf, size_t size)
+{
+	static const char chars[] = "0123456789000aAbzZ..-_+~^\xe9";
+	size_t len = rnd() % (size - 1);
+	size_t i = 0;
+
+	while (i < len) {
+		/* mostly runs of one kind, like real versions */
+		int run = 1 + rnd() % 4;
+		char c = chars[rnd() % (sizeof(chars) - 1)];
+
+		while (run-- && i < len) {
+			buf[i++] = c;
+			if (c >= '0' && c <= '9')
+				c = '0' + rnd() % 10;
+		}
+	}
+	buf[i] = '\0';
+}
+
+static int sign(int rc)
+{
+	return rc < 0 ? -1 : rc > 0;
+}
+
+static int check(const char *a, const char *b)
+{
+	int expected = sign(rpmvercmp(a, b));
+	int got = sign(nvr_vercmp(a, b));
+
+	if (expected == got)
+		return 0;
+
+	fprintf(stderr, "vercmp(\"%s\", \"%s\"): expected %d, got %d\n",
+		a, b, expected, got);
+	return 1;
+}
+
+int main(void)
+{
+	size_t n_fixed = sizeof(fixed) / sizeof(fixed[0]);
+	char a[24], b[24];
+	int failed = 0;
+	size_t i, j;
+
+	for (i = 0; i < n_fixed; i++)
+		for (j = 0; j < n_fixed; j++)
+			failed += check(fixed[i], fixed[j]);
+
+	for (i = 0; i < N_RANDOM; i++) {
+		random_version(a, sizeof(a));
+		/* share a prefix half of the time, so later segments get
+		 * compared too */
+		if (rnd() % 2) {
+			size_t keep = strlen(a) ? rnd() % strlen(a) : 0;
+
+			memcpy(b, a, keep);
+			random_version(b + keep, sizeof(b) - keep);
+		} else {
+			random_version(b, sizeof(b));
+		}
+		failed += check(a, b);
+	}
+
+	printf("vercmp: %zu comparisons, %d differences\n",
+	       n_fixed * n_fixed + N_RANDOM, failed);
+	return failed ? 1 : 0;
+}